@@ -6,6 +6,8 @@
 #include "os.h"
 #include "arena.h"
 #include "implicit_list.h"
+#include "memops.h"
+#include "maintenance.h"
 
 extern PartitionAllocator *partition_allocator;
 extern uintptr_t main_thread_id;
@@ -19,11 +21,18 @@ Allocator *allocator_aquire(uintptr_t thread_id, uintptr_t thr_mem)
     }
     Allocator *alloc = (Allocator *)thr_mem;
     alloc->prev_size = -1;
+    alloc->last_pool_purge = 0;
+    memset(alloc->pool_demand, 0, sizeof(alloc->pool_demand));
+    alloc->zeroed_bytes = 0;
+    alloc->fresh_zero_bytes = 0;
+    for (int32_t i = 0; i < PARTITION_COUNT; i++) {
+        alloc->home_block[i] = -1;
+    }
     thr_mem = ALIGN_CACHE(thr_mem + sizeof(Allocator));
     alloc->thread_id = thread_id;
     // next come the partition allocator structs.
     Queue *pool_queue = (Queue *)thr_mem;
-    thr_mem = ALIGN_CACHE(thr_mem + sizeof(Queue) * POOL_BIN_COUNT);
+    thr_mem = ALIGN_CACHE(thr_mem + sizeof(Queue) * POOL_QUEUE_COUNT);
     Queue *arena_queue = (Queue *)thr_mem;
     thr_mem = ALIGN_CACHE(thr_mem + sizeof(Queue) * PARTITION_COUNT);
     Queue *implicit_queue = (Queue *)thr_mem;
@@ -45,6 +54,7 @@ void* allocator_slot_alloc_null(Allocator*a,  const size_t as)
 void* allocator_slot_alloc_pool(Allocator*a,  const size_t as)
 {
     UNUSED(as);
+    a->c_slot.recycled = 1;
     return pool_aquire_block((Pool*)(a->c_slot.header));
 }
 
@@ -103,12 +113,13 @@ internal_alloc allocator_set_implicit_slot(Allocator *a, uintptr_t p, uint32_t m
     a->c_slot.start = 0;
     a->c_slot.end = 0;
     a->c_slot.is_zero = a->c_slot.is_zero;
+    a->c_slot.zero_offset = INT32_MAX;
     a->c_slot.counter = 0;
 
     return allocator_slot_alloc_implicit;
 }
 
-internal_alloc allocator_set_region_slot(Allocator *a, uintptr_t p)
+internal_alloc allocator_set_region_slot(Allocator *a, uintptr_t p, bool is_zero)
 {
     if(p == 0UL)
     {
@@ -118,6 +129,7 @@ internal_alloc allocator_set_region_slot(Allocator *a, uintptr_t p)
     a->c_slot.type = SLOT_REGION;
     a->c_slot.offset = 0;
     a->c_slot.end = 0;
+    a->c_slot.zero_offset = is_zero ? 0 : INT32_MAX;
     
     a->c_slot.block_size = 0;
     a->c_slot.alignment = 0;
@@ -136,6 +148,7 @@ internal_alloc allocator_set_os_slot(Allocator *a, uintptr_t p, size_t size)
     a->c_slot.type = SLOT_OS;
     a->c_slot.offset = 0;
     a->c_slot.end = (int32_t)size;
+    a->c_slot.zero_offset = 0;
     
     a->c_slot.block_size = 0;
     a->c_slot.alignment = (int32_t)os_page_size;
@@ -154,6 +167,7 @@ internal_alloc allocator_set_pool_slot(Allocator *a, Pool *p)
     a->c_slot.type = SLOT_POOL;
     a->c_slot.header = (uintptr_t)p;
     a->c_slot.block_size = (int32_t)p->block_size;
+    pool_touch(p);
     a->c_slot.alignment = p->alignment;
     a->c_slot.req_size = (int32_t)p->block_size;
     
@@ -162,17 +176,41 @@ internal_alloc allocator_set_pool_slot(Allocator *a, Pool *p)
     
     if(rem_blocks > 0)
     {
-        a->c_slot.offset = (int32_t)((uintptr_t)pool_base_address(p) - (uintptr_t)p);
+        // blocks past the arena's commit mark are taken a commit step at a time.
+        Arena* arena = arena_get_header((uintptr_t)p);
+        uint64_t data = (uintptr_t)pool_base_address(p) - (uintptr_t)arena;
+        if(arena_commit_to(arena, data + (uint64_t)(p->num_committed + 1) * p->block_size))
+        {
+            uint64_t writable = (atomic_load_explicit(&arena->commit_end, memory_order_relaxed) - data) / p->block_size;
+            uint64_t fresh = writable - p->num_committed;
+            rem_blocks = (int32_t)MIN((uint64_t)rem_blocks, fresh);
+        }
+        else
+        {
+            rem_blocks = 0;
+        }
+    }
+    if(rem_blocks > 0)
+    {
+        if(p->purged != 0)
+        {
+            pool_unpurge_blocks(p, p->num_committed, p->num_committed + rem_blocks);
+        }
+        // the slot takes the blocks past the ones handed out already.
+        int32_t base = (int32_t)((uintptr_t)pool_base_address(p) - (uintptr_t)p);
+        a->c_slot.offset = base + (int32_t)(p->num_committed * p->block_size);
         a->c_slot.start = a->c_slot.offset;
-        a->c_slot.end = (int32_t)(((uintptr_t)pool_base_address(p) - (uintptr_t)p) + (p->num_available * p->block_size));
-        // reserve all memory from the pool
-        p->num_used = p->num_available;
-        p->num_committed = p->num_available;
+        a->c_slot.end = a->c_slot.start + (int32_t)(rem_blocks * p->block_size);
+        a->c_slot.zero_offset = base + (int32_t)(p->zero_start * p->block_size);
+        // reserve the blocks of the slot
+        p->num_used += rem_blocks;
+        p->num_committed += rem_blocks;
         return allocator_slot_alloc;
     }
     a->c_slot.offset = 0;
     a->c_slot.end = 0;
     a->c_slot.start = 0;
+    a->c_slot.zero_offset = INT32_MAX;
     
     return allocator_slot_alloc_pool;
 }
@@ -185,6 +223,10 @@ internal_alloc allocator_set_arena_slot(Allocator *a, void *p, uint32_t block_si
         return allocator_slot_alloc_null;
     }
     Arena* arena = (Arena*)p;
+    if(!arena_commit_to(arena, (uint64_t)(start_idx + block_count)*block_size))
+    {
+        return allocator_slot_alloc_null;
+    }
     a->c_slot.header = (uintptr_t)p;
     a->c_slot.type = SLOT_ARENA;
     a->c_slot.block_size = block_size;
@@ -196,6 +238,9 @@ internal_alloc allocator_set_arena_slot(Allocator *a, void *p, uint32_t block_si
     
     uintptr_t end_mask = arena->in_use & ~((1ULL << start_idx) - 1);
     int32_t end_idx = end_mask == 0? 64 :__builtin_ctzll(end_mask);
+    // the slot stops at the commit mark, the next one moves it up.
+    uint64_t commit_end = atomic_load_explicit(&arena->commit_end, memory_order_relaxed);
+    end_idx = MIN(end_idx, (int32_t)(commit_end / block_size));
     int32_t max_zeros = end_idx - start_idx;
     
     // from the start idx... count the number of zeros
@@ -203,14 +248,26 @@ internal_alloc allocator_set_arena_slot(Allocator *a, void *p, uint32_t block_si
     a->c_slot.offset = a->c_slot.start;
     a->c_slot.end = a->c_slot.offset + max_zeros*a->c_slot.block_size;
     
+    // past the last chunk that has been handed out before, the slot is zero.
+    uint64_t span = (end_idx == 64 ? ~0ULL : ((1ULL << end_idx) - 1)) & ~((1ULL << start_idx) - 1);
+    uint64_t touched = span & ~atomic_load(&arena->zero);
+    a->c_slot.zero_offset = touched ? (64 - __builtin_clzll(touched))*a->c_slot.block_size : a->c_slot.start;
+    
     return allocator_slot_alloc;
 }
 
 static inline void allocator_release_pool_slot(Allocator *a)
 {
     Pool* p = (Pool*)(a->c_slot.header);
-    Queue *queue = &a->pools[p->block_idx];
     uint32_t rem_blocks = 0;
+    pool_touch(p);
+    if(a->c_slot.end > a->c_slot.start)
+    {
+        // everything below our offset has been handed out at some point.
+        int32_t base = (int32_t)((uintptr_t)pool_base_address(p) - (uintptr_t)p);
+        int32_t touched = (MAX(a->c_slot.offset, a->c_slot.zero_offset) - base)/a->c_slot.block_size;
+        p->zero_start = MAX(p->zero_start, touched);
+    }
     if(a->c_slot.offset < a->c_slot.end)
     {
         rem_blocks = (a->c_slot.end - a->c_slot.offset)/a->c_slot.block_size;
@@ -224,30 +281,22 @@ static inline void allocator_release_pool_slot(Allocator *a)
             }
         }
         
-        if(!pool_is_connected(p) && queue->head != p)
+        if(!pool_is_queued(a, p))
         {
-            list_enqueue(queue, p);
             pool_post_used(p);
         }
     }
-    else
-    {
-        if(pool_is_consumed(p))
-        {
-            p->is_zero = 0; // Mark pool as not zeroed
-            if(is_connected_to_list(queue, p))
-            {
-                list_move_to_back(queue, p);
-            }
-        }
-        
-    }
+    pool_rebin(a, p);
 
     //
     a->c_slot.offset = 0;
     a->c_slot.end = 0;
     a->c_slot.header = 0;
     a->c_slot.start = 0;
+    if(p->bin == POOL_EMPTY)
+    {
+        allocator_trim_empty_pools(a, p->block_idx);
+    }
 }
 
 static inline void allocator_release_arena_slot(Allocator *a)
@@ -260,6 +309,17 @@ static inline void allocator_release_arena_slot(Allocator *a)
     uint64_t mask = (1ULL << (count*block_count) ) - 1;
     size_t sidx = cidx - (count*block_count);
     p->in_use |= (mask << sidx);
+    arena_touch(p, mask << sidx);
+    
+    // chunks handed out from the slot, including any that came back
+    // to it, are not zero anymore.
+    size_t zidx = MAX(a->c_slot.offset, a->c_slot.zero_offset) / a->c_slot.block_size;
+    size_t first = a->c_slot.start / a->c_slot.block_size;
+    if(zidx > first)
+    {
+        uint64_t touched = (zidx == 64 ? ~0ULL : ((1ULL << zidx) - 1)) & ~((1ULL << first) - 1);
+        atomic_fetch_and_explicit(&p->zero, ~touched, memory_order_release);
+    }
     
     if(block_count > 1)
     {
@@ -309,7 +369,6 @@ static inline void allocator_release_slot(Allocator *a)
 
 void * allocator_alloc_region(Allocator* alloc, int32_t partition_idx, int32_t num_regions, int32_t* region_idx, int32_t* is_zero, bool zero, bool active)
 {
-    UNUSED(alloc);
     if (partition_idx < 0 || partition_idx >= PARTITION_COUNT) {
         return NULL;
     }
@@ -317,7 +376,8 @@ void * allocator_alloc_region(Allocator* alloc, int32_t partition_idx, int32_t n
     // find an arena to remove
     allocator_try_release_local_area(alloc,partition_idx);
     
-    return partition_allocator_get_free_region(partition_allocator, partition_idx, num_regions, region_idx, is_zero, zero, active);
+    return partition_allocator_get_free_region(partition_allocator, partition_idx, num_regions, region_idx, is_zero, zero, active,
+                                               &alloc->home_block[partition_idx]);
 }
 
 internal_alloc allocator_load_region_slot(Allocator *a, bool zero, bool active)
@@ -327,7 +387,7 @@ internal_alloc allocator_load_region_slot(Allocator *a, bool zero, bool active)
     void* region = allocator_alloc_region(a, AT_FIXED_256, 1, &region_idx, &is_zero, zero, active);
     if(region)
     {
-        return allocator_set_region_slot(a, (uintptr_t)region);
+        return allocator_set_region_slot(a, (uintptr_t)region, is_zero);
     }
     else
     {
@@ -338,36 +398,214 @@ internal_alloc allocator_load_region_slot(Allocator *a, bool zero, bool active)
 
 internal_alloc allocator_malloc_pool_find_fit(Allocator* alloc, const uint32_t pc)
 {
-    // check if there are any pools available.
-    Queue *queue = &alloc->pools[pc];
-    alloc_base* start = queue->head;
-    
-    if(start != NULL)
+    // the fullest pool with room goes first, so sparse pools drain and
+    // their chunks can go back to the arena.
+    for(int32_t bin = POOL_MOSTLY_FULL; bin <= POOL_EMPTY; bin++)
     {
-        if(pool_is_unused((Pool*)start))
+        Queue *queue = &alloc->pools[pc * POOL_OCCUPANCY_BINS + bin];
+        Pool* start = queue->head;
+        while(start != NULL)
         {
-            pool_clear((Pool*)start);
-            return allocator_set_pool_slot(alloc, (Pool *)start);
+            Pool* next = start->next;
+            // frees from other threads don't touch the queues, so a pool
+            // can be filed under a stale bin.
+            pool_rebin(alloc, start);
+            if(start->bin == bin)
+            {
+                if(bin == POOL_EMPTY)
+                {
+                    pool_clear(start);
+                }
+                return allocator_set_pool_slot(alloc, start);
+            }
+            start = next;
         }
-        else if(!pool_is_consumed((Pool*)start))
+    }
+    return allocator_slot_alloc_null;
+}
+
+// claim the blocks other threads freed into our pools. pools they emptied
+// out of the full bin can be searched again after this.
+static bool allocator_claim_remote_frees(Allocator* alloc)
+{
+    bool claimed = false;
+    for(int32_t i = 0; i < PARTITION_COUNT; i++)
+    {
+        alloc_base* start = alloc->arenas[i].head;
+        while(start != NULL)
         {
-            return allocator_set_pool_slot(alloc, (Pool *)start);
+            alloc_base* next = start->next;
+            if(atomic_load(&((Arena*)start)->dirty) != 0)
+            {
+                arena_clear_dirty(alloc, (Arena*)start);
+                claimed = true;
+            }
+            start = next;
         }
-        else if(pool_is_consumed((Pool*)start))
+    }
+    return claimed;
+}
+
+// take a region out of the abandoned set, the caller owns it after this.
+static inline bool allocator_claim_abandoned(Allocator* alloc, Arena* h)
+{
+    if(atomic_load(&h->thread_id) != -1 ||
+       !partition_allocator_claim_abandoned(partition_allocator, h))
+    {
+        return false;
+    }
+    atomic_store_explicit(&h->thread_id, alloc->thread_id, memory_order_release);
+    return true;
+}
+
+// give a claimed region that had nothing for us back to the abandoned set.
+static inline void allocator_unclaim(Arena* h)
+{
+    atomic_store_explicit(&h->thread_id, -1, memory_order_release);
+    partition_allocator_abandon_blocks(partition_allocator, h);
+}
+
+// file a claimed region in our queues.
+static void allocator_file_adopted(Allocator* alloc, Arena* h)
+{
+    if(get_base_type((alloc_base*)h) == SLOT_IMPLICIT)
+    {
+        ImplicitList* list = (ImplicitList*)h;
+        list_enqueue(&alloc->implicit[list->partition_id], list);
+        return;
+    }
+    list_enqueue(&alloc->arenas[h->partition_id], h);
+    // the pools were unlinked when the owner died, file them with ours.
+    uint64_t active = atomic_load(&h->active);
+    size_t chunk_size = ARENA_CHUNK_SIZE(h->partition_id);
+    while(active != 0)
+    {
+        int32_t idx = __builtin_ctzll(active);
+        active &= active - 1;
+        pool_rebin(alloc, (Pool*)((uintptr_t)h + idx * chunk_size));
+    }
+}
+
+// the remote frees are only ours to take once the region is claimed.
+static inline void allocator_take_adopted_frees(Allocator* alloc, Arena* h)
+{
+    if(get_base_type((alloc_base*)h) == SLOT_IMPLICIT)
+    {
+        implicitList_move_deferred((ImplicitList*)h);
+    }
+    else if(atomic_load(&h->dirty) != 0)
+    {
+        arena_clear_dirty(alloc, h);
+    }
+}
+
+bool allocator_adopt(Allocator* alloc, void* region)
+{
+    Arena* h = (Arena*)region;
+    if(!allocator_claim_abandoned(alloc, h))
+    {
+        return false;
+    }
+    allocator_take_adopted_frees(alloc, h);
+    allocator_file_adopted(alloc, h);
+    return true;
+}
+
+// chunk index of a pool of class pc in the arena that has room, -1 if none.
+static inline int32_t allocator_arena_pool_room(Arena* arena, uint32_t pc)
+{
+    uint64_t active = atomic_load(&arena->active);
+    size_t chunk_size = ARENA_CHUNK_SIZE(arena->partition_id);
+    while(active != 0)
+    {
+        int32_t idx = __builtin_ctzll(active);
+        active &= active - 1;
+        Pool* p = (Pool*)((uintptr_t)arena + idx * chunk_size);
+        if(p->block_idx == pc && pool_occupancy_of(p) != POOL_FULL)
         {
-            list_move_to_back(queue, start);
+            return idx;
         }
     }
-    return allocator_slot_alloc_null;
+    return -1;
+}
+
+// first run of free chunks in the arena, -1 if none.
+static inline int32_t allocator_arena_chunk_room(Arena* arena, int32_t min_free_blocks, uint8_t exp, bool pool)
+{
+    uint64_t in_use = atomic_load(&arena->in_use);
+    if(!pool)
+    {
+        in_use |= atomic_load(&arena->active);
+    }
+    return find_first_nzeros(in_use, min_free_blocks, exp);
+}
+
+// Arenas of dead threads are taken over before a new region is reserved.
+// With pc >= 0 an arena qualifies when one of its pools of that class has
+// room, otherwise when it has min_free_blocks free chunks, whose index goes
+// to midx. Another thread may be taking an arena over at the same time,
+// so only the region type, which stays put while the region is abandoned,
+// is read before the claim.
+static Arena* allocator_adopt_arena(Allocator* alloc, int32_t arena_idx,
+                                    int32_t min_free_blocks, uint8_t exp,
+                                    bool pool, int32_t pc, int32_t* midx)
+{
+    void* region = partition_allocator_next_abandoned(partition_allocator, arena_idx, NULL);
+    while(region != NULL)
+    {
+        Arena* arena = (Arena*)region;
+        void* next = partition_allocator_next_abandoned(partition_allocator, arena_idx, region);
+        if(get_base_type((alloc_base*)arena) == SLOT_ARENA && allocator_claim_abandoned(alloc, arena))
+        {
+            allocator_take_adopted_frees(alloc, arena);
+            int32_t idx = pc >= 0 ? allocator_arena_pool_room(arena, (uint32_t)pc)
+                                  : allocator_arena_chunk_room(arena, min_free_blocks, exp, pool);
+            if(idx != -1)
+            {
+                allocator_file_adopted(alloc, arena);
+                *midx = pc >= 0 ? 0 : idx;
+                return arena;
+            }
+            allocator_unclaim(arena);
+        }
+        region = next;
+    }
+    return NULL;
+}
+
+static ImplicitList* allocator_adopt_implicit(Allocator* alloc, int32_t partition_idx, size_t min_size)
+{
+    void* region = partition_allocator_next_abandoned(partition_allocator, partition_idx, NULL);
+    while(region != NULL)
+    {
+        Arena* h = (Arena*)region;
+        void* next = partition_allocator_next_abandoned(partition_allocator, partition_idx, region);
+        if(get_base_type((alloc_base*)h) == SLOT_IMPLICIT && allocator_claim_abandoned(alloc, h))
+        {
+            allocator_take_adopted_frees(alloc, h);
+            if(implicitList_has_room((ImplicitList*)h, min_size))
+            {
+                allocator_file_adopted(alloc, h);
+                return (ImplicitList*)h;
+            }
+            allocator_unclaim(h);
+        }
+        region = next;
+    }
+    return NULL;
 }
 
 static inline uintptr_t allocator_get_arena_blocks(Allocator* alloc, int32_t arena_idx,
                                                    int32_t min_free_blocks, uint8_t exp,
-                                                   bool zero, int32_t* midx)
+                                                   bool pool, bool zero, int32_t* midx)
 {
     Queue* aqueue = &alloc->arenas[arena_idx];
     alloc_base* start = aqueue->head;
     *midx = 0;
+    // address ordered placement looks at every arena and keeps the lowest.
+    bool lowest = partition_allocator_get_placement() == PLACEMENT_ADDRESS_ORDERED;
+    alloc_base* best = NULL;
+    int32_t best_idx = 0;
     
     // !active && in_use... in fully consumed but not in cache.
     // active && in_use... in cache and has memory handed out.
@@ -382,23 +620,55 @@ static inline uintptr_t allocator_get_arena_blocks(Allocator* alloc, int32_t are
         if(dirty != 0)
         {
             // if the arena has dirty blocks, we need to clear them.
-            arena_clear_dirty(arena);
+            arena_clear_dirty(alloc, arena);
         }
         uint64_t in_use = atomic_load(&arena->in_use);
+        if(!pool)
+        {
+            // chunk runs can't take over chunks that pools are cached in.
+            in_use |= atomic_load(&arena->active);
+        }
         if(in_use != UINT64_MAX)
         {
-            if((*midx = find_first_nzeros(in_use, min_free_blocks, exp)) != -1)
+            // zeroed requests would rather take chunks that are still zero.
+            int32_t idx = -1;
+            if(zero)
             {
-                // in this case...
-                break;
+                idx = find_first_nzeros(in_use | ~atomic_load(&arena->zero), min_free_blocks, exp);
+            }
+            if(idx == -1)
+            {
+                idx = find_first_nzeros(in_use, min_free_blocks, exp);
+            }
+            if(idx != -1)
+            {
+                if(!lowest)
+                {
+                    *midx = idx;
+                    break;
+                }
+                if(best == NULL || (uintptr_t)start < (uintptr_t)best)
+                {
+                    best = start;
+                    best_idx = idx;
+                }
             }
         }
         
         start = next;
     }
+    if(best != NULL)
+    {
+        start = best;
+        *midx = best_idx;
+    }
 
 
     
+    if(start == NULL)
+    {
+        start = (alloc_base*)allocator_adopt_arena(alloc, arena_idx, min_free_blocks, exp, pool, -1, midx);
+    }
     if(start == NULL)
     {
         int32_t region_idx = 0;
@@ -413,6 +683,17 @@ static inline uintptr_t allocator_get_arena_blocks(Allocator* alloc, int32_t are
             arena->idx = (region_idx << 4)| SLOT_ARENA;
             arena->in_use = 1;
             arena->zero = is_zero ? ~UINT64_C(0) : 0;
+            arena->idle = 0;
+            arena->purged = 0;
+            arena->idle_since = maintenance_now_ms();
+            arena->cold = 0;
+            arena->paged = 0;
+            atomic_store(&arena->commit_end, partition_allocator_initial_commit(ARENA_SIZE(arena_idx)));
+            uint32_t stamp = (uint32_t)(arena->idle_since >> ARENA_AGE_SHIFT);
+            for(int32_t i = 0; i < 64; i++)
+            {
+                arena->touched[i] = stamp;
+            }
 
             if(!arena_is_connected(arena) && aqueue->head != arena)
             {
@@ -430,15 +711,25 @@ static inline uintptr_t allocator_get_arena_blocks(Allocator* alloc, int32_t are
     Arena* arena = (Arena*)start;
     uint64_t active = atomic_load(&arena->active);
     uintptr_t new_chunk = ((uintptr_t)start + (*midx * block_size));
+    if(pool && (active & (1ULL << *midx)) == 0 &&
+       !arena_commit_to(arena, (uint64_t)*midx * block_size + sizeof(Pool)))
+    {
+        // no commit charge left for the header of a new pool.
+        return 0;
+    }
+    if(!pool)
+    {
+        // only pools are tracked as active, runs are tracked by their range.
+        return new_chunk;
+    }
     if((active & (1ULL <<  *midx)) != 0)
     {
         // if the memory is active, that means that it is found in a queue
         // at this level we only store active states for pools.
         Pool* new_pool = (Pool*)new_chunk;
-        Queue *pqueue = &alloc->pools[new_pool->block_idx];
-        if(is_connected_to_list(pqueue, new_pool))
+        if(pool_is_queued(alloc, new_pool))
         {
-            list_remove(pqueue, new_pool);
+            list_remove(pool_queue(alloc, new_pool), new_pool);
         }
     }
     else
@@ -463,13 +754,36 @@ static bool is_multiple_of_power_in_range(uint32_t size, uint32_t *largest_power
     }
 }
 
+// the full chunk of the row for classes in demand, a small one for the rest.
+static inline uint8_t allocator_pool_partition(Allocator* alloc, uint8_t pc)
+{
+    uint8_t hot = MIN(pool_row(pc), 5);
+    if(alloc->pool_demand[pc] >= POOL_WARM_DEMAND)
+    {
+        return hot;
+    }
+    size_t block_size = pool_block_size(pc);
+    size_t need = ALIGN_UP_2(sizeof(Pool), 1ULL << __builtin_ctzll(block_size)) + POOL_COLD_BLOCKS*block_size;
+    uint8_t pid = 0;
+    while(pid < hot && ARENA_CHUNK_SIZE(pid) < need)
+    {
+        pid++;
+    }
+    return pid;
+}
+
 static inline void allocator_malloc_leq_32k_init(Allocator* alloc, const size_t size, const size_t alignment, const bool zero)
 {
     uint8_t pc = size_to_pool(size);
-    int32_t row = pc/8;
+    if(pc >= POOL_FIXED_COUNT && (pool_block_size(pc) & (alignment - 1)) != 0)
+    {
+        // registered classes only keep the alignment of their size.
+        pc = size_to_fixed_pool(size);
+    }
+    int32_t row = pool_row(pc);
     uint8_t arena_idx = MIN(row, 5);
-    alloc->c_back.min_size = pc == 0? 0 : (pool_sizes[pc-1] + 1);
-    alloc->c_back.max_size = pool_sizes[pc];
+    alloc->c_back.min_size = pool_class_floor(pc);
+    alloc->c_back.max_size = pool_block_size(pc);
     alloc->c_back.partition_index = arena_idx;
     alloc->c_back.exp = pc; // hijack this member for our pools
     alloc->c_slot.type = SLOT_POOL;
@@ -505,7 +819,8 @@ static inline void allocator_malloc_leq_4m_init(Allocator* alloc, const size_t s
     const uint32_t as_exp = ARENA_CHUNK_SIZE_EXPONENT(alloc->c_back.partition_index);
     if(power2)
     {
-        alloc->c_back.num_blocks = size >> as_exp;
+        // multiples of a smaller power round up to whole chunks.
+        alloc->c_back.num_blocks = (size + ((1ULL << as_exp) - 1)) >> as_exp;
         size_t delta = (alignment >> as_exp);
         alloc->c_back.exp = delta == 0? 0 : __builtin_ctzll(delta);
         alloc->c_slot.type = SLOT_ARENA;
@@ -547,16 +862,13 @@ static inline void allocator_malloc_leq_32m_init(Allocator* alloc, const size_t
                 alloc->c_back.partition_index++;
             }
             use_arena = true;
-            alloc->c_back.partition_index = bitlength((uint32_t)result_power >> 23);
         }
     }
     
     if(use_arena)
     {
-        if(power2)
-        {
-            alloc->c_back.partition_index = bitlength((uint32_t)size >> 23);
-        }
+        // a single region that is large enough to hold the whole request.
+        alloc->c_back.partition_index = bitlength((uint32_t)(size - 1) >> 22);
         
         const uint32_t as_exp = ARENA_CHUNK_SIZE_EXPONENT(alloc->c_back.partition_index);
         
@@ -581,8 +893,27 @@ static inline internal_alloc allocator_malloc_back(Allocator* alloc, size_t alig
 {
     if(alloc->c_slot.type == SLOT_POOL)
     {
+        if(alloc->pool_demand[alloc->c_back.exp] < POOL_RETAIN_MAX)
+        {
+            alloc->pool_demand[alloc->c_back.exp]++;
+        }
         internal_alloc res = allocator_malloc_pool_find_fit(alloc,
                                                             alloc->c_back.exp);
+        if(res == allocator_slot_alloc_null && allocator_claim_remote_frees(alloc))
+        {
+            res = allocator_malloc_pool_find_fit(alloc, alloc->c_back.exp);
+        }
+        if(res == allocator_slot_alloc_null)
+        {
+            int32_t midx = 0;
+            alloc->c_back.partition_index = allocator_pool_partition(alloc, alloc->c_back.exp);
+            // pools of this class a dead thread left behind come before a new one.
+            if(allocator_adopt_arena(alloc, alloc->c_back.partition_index, 1, 0, true,
+                                     (int32_t)alloc->c_back.exp, &midx) != NULL)
+            {
+                res = allocator_malloc_pool_find_fit(alloc, alloc->c_back.exp);
+            }
+        }
         if(res == allocator_slot_alloc_null)
         {
             int32_t midx = 0;
@@ -591,6 +922,7 @@ static inline internal_alloc allocator_malloc_back(Allocator* alloc, size_t alig
                                                  alloc->c_back.partition_index,
                                                  1,
                                                  0,
+                                                 true,
                                                  alloc->c_slot.is_zero,
                                                  &midx);
             if(start != 0)
@@ -606,13 +938,9 @@ static inline internal_alloc allocator_malloc_back(Allocator* alloc, size_t alig
                 }
                 Pool* new_pool = (Pool*)start;
                 pool_init(new_pool, midx, alloc->c_back.exp, (uint32_t)block_size);
-                new_pool->is_zero = is_zero;
+                new_pool->zero_start = is_zero ? 0 : new_pool->num_available;
                 res = allocator_set_pool_slot(alloc, new_pool);
-                Queue *aqueue = &alloc->pools[alloc->c_back.exp];
-                if(!pool_is_connected(new_pool) && aqueue->head != new_pool)
-                {
-                    list_enqueue(aqueue, new_pool);
-                }
+                pool_rebin(alloc, new_pool);
             }
         }
         return res;
@@ -625,6 +953,7 @@ static inline internal_alloc allocator_malloc_back(Allocator* alloc, size_t alig
                                                      (int32_t)alloc->c_back.partition_index,
                                                      (uint32_t)alloc->c_back.num_blocks,
                                                      (uint32_t)alloc->c_back.exp,
+                                                     false,
                                                      alloc->c_slot.is_zero,
                                                      &midx);
         // we allocate a single block
@@ -664,6 +993,11 @@ static inline internal_alloc allocator_malloc_back(Allocator* alloc, size_t alig
             start = next;
         }
         if(start == NULL)
+        {
+            start = (alloc_base*)allocator_adopt_implicit(alloc, alloc->c_back.partition_index,
+                                                          alloc->c_back.min_size);
+        }
+        if(start == NULL)
         {
             uintptr_t region = (uintptr_t)allocator_alloc_region(alloc,
                                                                 alloc->c_back.partition_index,
@@ -702,7 +1036,7 @@ static inline internal_alloc allocator_malloc_back(Allocator* alloc, size_t alig
                                                             &is_zero,
                                                             alloc->c_slot.is_zero,
                                                             false);
-        return allocator_set_region_slot(alloc, start);
+        return allocator_set_region_slot(alloc, start, is_zero);
     }
     else if(alloc->c_slot.type == SLOT_OS)
     {
@@ -719,23 +1053,10 @@ static inline internal_alloc allocator_malloc_back(Allocator* alloc, size_t alig
     return allocator_slot_alloc_null;
 }
 
-static inline internal_alloc allocator_malloc_base(Allocator* alloc, size_t size, size_t alignment, const bool zero)
+static inline void allocator_malloc_init(Allocator* alloc, size_t size, size_t alignment, const bool zero)
 {
-    // are we requesting similar blocks.
-    if(alloc->c_back.header)
-    {
-        if(size >= alloc->c_back.min_size && size <= alloc->c_back.max_size)
-        {
-            if((int32_t)alignment == alloc->c_slot.alignment)
-            {
-                return allocator_malloc_back(alloc, alignment);
-            }
-        }
-    }
-    
     memset(&alloc->c_back, 0, sizeof(alloc_slot_back));
     
-    
     if(size <= (1 << 15)) // 8 <= n <= 32k
     {
         allocator_malloc_leq_32k_init(alloc, size, alignment, zero);
@@ -751,11 +1072,59 @@ static inline internal_alloc allocator_malloc_base(Allocator* alloc, size_t size
     else // n > 32m
     {
         alloc->c_slot.type = SLOT_OS;
+        alloc->c_back.max_size = size;
     }
+}
 
+static inline internal_alloc allocator_malloc_base(Allocator* alloc, size_t size, size_t alignment, const bool zero)
+{
+    // are we requesting similar blocks.
+    if(alloc->c_back.header)
+    {
+        if(size >= alloc->c_back.min_size && size <= alloc->c_back.max_size)
+        {
+            // boundary tag lists forward exact powers of two to the arenas,
+            // so those can't share an implicit size range.
+            if((int32_t)alignment == alloc->c_slot.alignment &&
+               (alloc->c_slot.type != SLOT_IMPLICIT || !POWER_OF_TWO(size)))
+            {
+                return allocator_malloc_back(alloc, alignment);
+            }
+        }
+    }
+    
+    allocator_malloc_init(alloc, size, alignment, zero);
     return allocator_malloc_back(alloc, alignment);
 }
 
+size_t allocator_good_size(size_t size)
+{
+    // run the request through the same routing an allocation takes.
+    Allocator probe = {0};
+    const size_t req_size = size;
+    size = ALIGN(size);
+    allocator_malloc_init(&probe, size, sizeof(intptr_t), false);
+    switch(probe.c_slot.type)
+    {
+        case SLOT_POOL:
+            return pool_block_size(probe.c_back.exp);
+        case SLOT_ARENA:
+            return (size_t)probe.c_back.num_blocks << ARENA_CHUNK_SIZE_EXPONENT(probe.c_back.partition_index);
+        case SLOT_IMPLICIT:
+            // the boundary tags are sized from the unaligned request.
+            return implicitList_get_good_size((uint32_t)req_size) - HEADER_OVERHEAD;
+        case SLOT_REGION:
+            return region_size_from_partition_id(probe.c_back.partition_index);
+        case SLOT_OS:
+        {
+            size_t os_size = MAX(probe.c_back.max_size, os_page_size);
+            return ALIGN_UP_2(os_size + os_page_size, os_page_size) - os_page_size;
+        }
+        default:
+            return size;
+    }
+}
+
 
 
 static inline internal_alloc allocator_load_memory_slot(Allocator *a, size_t as, size_t alignment, bool zero)
@@ -802,6 +1171,12 @@ static void *allocator_malloc_slot_pool(Allocator *a, size_t s, void *res)
                 }
             }
         }
+        // sizes of another class go find a slot of their own.
+        if(s > (size_t)a->c_slot.block_size ||
+           size_to_pool(s) != ((Pool*)(a->c_slot.header))->block_idx)
+        {
+            return NULL;
+        }
     }
     return allocator_slot_alloc_pool(a, s);
 }
@@ -820,24 +1195,8 @@ static void *allocator_malloc_slot(Allocator *a, size_t s, void* res)
     return NULL;
 }
 
-void *allocator_malloc(const Allocator_param *prm)
+static inline void *_allocator_malloc(Allocator *a, size_t s, size_t align, bool zero)
 {
-    size_t s = prm->size;
-    size_t align = prm->alignment;
-    bool zero = prm->zero;
-    Allocator* a = NULL;
-    
-    // if this is our main thread, we pick up our cozy global.
-    if(prm->thread_id == main_thread_id)
-    {
-        a = main_instance;
-    }
-    else
-    {
-        // else we need to fetch the instance for this thread
-        a = get_instance(prm->thread_id);
-    }
-    
     // Check our front-end contiguous cache
     if(a->c_slot.header)
     {
@@ -913,6 +1272,98 @@ void *allocator_malloc(const Allocator_param *prm)
     return ialloc(a, s);
 }
 
+static inline bool allocator_is_known_zero(Allocator *a, void *p)
+{
+    if((uintptr_t)p > BASE_OS_ALLOC_ADDRESS && (uintptr_t)p < OS_ALLOC_END)
+    {
+        // os allocations are always freshly mapped.
+        return true;
+    }
+    if(a->c_slot.header == 0)
+    {
+        return false;
+    }
+    int64_t offset = (int64_t)((uintptr_t)p - a->c_slot.header);
+    switch(a->c_slot.type)
+    {
+        case SLOT_POOL:
+        case SLOT_ARENA:
+            // handed out by the bump pointer from past the zero mark.
+            return !a->c_slot.recycled &&
+                   offset >= a->c_slot.zero_offset && offset < a->c_slot.end;
+        case SLOT_REGION:
+            return offset == 0 && a->c_slot.zero_offset == 0;
+        case SLOT_IMPLICIT:
+            return ((ImplicitList*)a->c_slot.header)->last_zero != 0;
+        default:
+            return false;
+    }
+}
+
+static inline void allocator_zero_block(Allocator *a, void *p, size_t s)
+{
+    if(allocator_is_known_zero(a, p))
+    {
+        if(a->c_slot.type == SLOT_IMPLICIT)
+        {
+            // only the free list links were ever written here.
+            size_t links = MIN(s, sizeof(QNode));
+            memset(p, 0, links);
+            a->zeroed_bytes += links;
+            s -= links;
+        }
+        a->fresh_zero_bytes += s;
+        return;
+    }
+    // recycled memory.
+    mem_zero(p, s);
+    a->zeroed_bytes += s;
+}
+
+void *allocator_malloc(const Allocator_param *prm)
+{
+    Allocator* a = NULL;
+    
+    // if this is our main thread, we pick up our cozy global.
+    if(prm->thread_id == main_thread_id)
+    {
+        a = main_instance;
+    }
+    else
+    {
+        // else we need to fetch the instance for this thread
+        a = get_instance(prm->thread_id);
+    }
+    
+    if(pool_profiling)
+    {
+        pool_profile_record(prm->size);
+    }
+    if(prm->zero)
+    {
+        // the pool free list path flags the blocks it recycles.
+        a->c_slot.recycled = 0;
+    }
+    void *res = _allocator_malloc(a, prm->size, prm->alignment, prm->zero);
+    if(prm->zero && res != NULL)
+    {
+        allocator_zero_block(a, res, prm->size);
+    }
+    return res;
+}
+
+void allocator_zero_stats(Allocator *a, size_t *zeroed, size_t *fresh)
+{
+    if(zeroed != NULL)
+    {
+        *zeroed = (size_t)a->zeroed_bytes;
+    }
+    if(fresh != NULL)
+    {
+        *fresh = (size_t)a->fresh_zero_bytes;
+    }
+}
+
 static inline __attribute__((always_inline)) void _allocator_free(Allocator *a, void *p)
 {
     // always safe to free NULL
@@ -933,6 +1384,7 @@ static inline __attribute__((always_inline)) void _allocator_free(Allocator *a,
     {
         // we just returned the last memory allocated
         // so we just offset our slot.
+        a->c_slot.zero_offset = MAX(a->c_slot.zero_offset, a->c_slot.offset);
         a->c_slot.offset -=a->c_slot.req_size;
         return;
     }
@@ -964,7 +1416,7 @@ void allocator_release_deferred(Allocator* a)
 {
     // Walk over all of our pools and move deferred memory
     // to its home.
-    for (int j = 0; j < POOL_BIN_COUNT; j++) {
+    for (int j = 0; j < POOL_QUEUE_COUNT; j++) {
         Pool* start = a->pools[j].head;
         while(start != NULL)
         {
@@ -974,14 +1426,120 @@ void allocator_release_deferred(Allocator* a)
             {
                 pool_set_unused(start);
             }
+            pool_rebin(a, start);
             start = next;
         }
     }
+    for (uint32_t j = 0; j < POOL_BIN_COUNT; j++) {
+        allocator_trim_empty_pools(a, j);
+    }
+}
+
+// Empty pools past what the class has asked for lately give their chunk
+// back to the arena, where runs and other classes can pick it up.
+void allocator_trim_empty_pools(Allocator *a, uint32_t block_idx)
+{
+    Queue *queue = &a->pools[block_idx * POOL_OCCUPANCY_BINS + POOL_EMPTY];
+    uint64_t cap = MAX(a->pool_demand[block_idx], POOL_RETAIN_MIN);
+    // the tail has been empty the longest.
+    Pool *p = queue->tail;
+    while(p != NULL && queue->count > cap)
+    {
+        Pool *prev = p->prev;
+        if((uintptr_t)p != a->c_slot.header && (uintptr_t)p != a->c_deferred.start &&
+           pool_occupancy_of(p) == POOL_EMPTY && atomic_load(&p->thread_free) == NULL)
+        {
+            list_remove(queue, p);
+            Arena *arena = arena_get_header((uintptr_t)p);
+            int32_t pidx = p->idx >> 4;
+            atomic_fetch_and_explicit(&arena->active, ~(1ULL << pidx), memory_order_release);
+            arena_free_blocks(a, arena, pidx);
+        }
+        p = prev;
+    }
+}
+
+// Give back the pages of free blocks in pools that are still in use, and
+// of arena chunks that have been idle for a while.
+// chunks the allocator holds in its caches without marking them.
+static inline uint64_t allocator_cached_chunks(Allocator *a, Arena *arena)
+{
+    uint64_t mask = 0;
+    if(a->c_slot.type == SLOT_ARENA && a->c_slot.header == (uintptr_t)arena && a->c_slot.end > a->c_slot.start)
+    {
+        // the chunks of the current slot aren't marked in use yet.
+        uint32_t first = (uint32_t)(a->c_slot.start / a->c_slot.block_size);
+        uint32_t last = (uint32_t)((a->c_slot.end - 1) / a->c_slot.block_size);
+        mask = (last >= 63 ? ~0ULL : ((1ULL << (last + 1)) - 1)) & ~((1ULL << first) - 1);
+    }
+    // the pools of the current slot and free batch are busy without being touched.
+    uintptr_t pools[2] = {a->c_slot.type == SLOT_POOL ? a->c_slot.header : 0,
+                          a->c_deferred.end != 0 ? a->c_deferred.start : 0};
+    uint32_t c_exp = ARENA_CHUNK_SIZE_EXPONENT(arena->partition_id);
+    for(int i = 0; i < 2; i++)
+    {
+        if(pools[i] > (uintptr_t)arena && pools[i] < (uintptr_t)arena + ARENA_SIZE(arena->partition_id))
+        {
+            mask |= 1ULL << ((pools[i] - (uintptr_t)arena) >> c_exp);
+        }
+    }
+    return mask;
+}
+
+size_t allocator_age_idle(Allocator *a, uint64_t now)
+{
+    size_t aged = 0;
+    for(int32_t i = 0; i < ARENA_BIN_COUNT; i++){
+        Arena* start = a->arenas[i].head;
+        while(start != NULL)
+        {
+            aged += arena_age_idle(start, now, allocator_cached_chunks(a, start));
+            start = start->next;
+        }
+    }
+    return aged;
+}
+
+static size_t allocator_purge_idle(Allocator *a, uint64_t now)
+{
+    size_t purged = 0;
+    // the retention caps follow the recent pool demand of each class.
+    for (uint32_t j = 0; j < POOL_BIN_COUNT; j++) {
+        a->pool_demand[j] >>= 1;
+        allocator_trim_empty_pools(a, j);
+    }
+    for(int32_t i = 0; i < ARENA_BIN_COUNT; i++){
+        Arena* start = a->arenas[i].head;
+        while(start != NULL)
+        {
+            purged += arena_purge_idle(start, now, allocator_cached_chunks(a, start));
+            start = start->next;
+        }
+    }
+    allocator_age_idle(a, now);
+    for (int j = 0; j < POOL_QUEUE_COUNT; j++) {
+        Pool* start = a->pools[j].head;
+        while(start != NULL)
+        {
+            // the current slot and free batch hold blocks the pool can't see.
+            if((uintptr_t)start != a->c_slot.header && (uintptr_t)start != a->c_deferred.start)
+            {
+                purged += pool_purge_free_pages(start);
+            }
+            start = start->next;
+        }
+    }
+    return purged;
 }
 
 bool allocator_try_release_local_area(Allocator *a, int32_t partition_id)
 {
-    uint64_t ct = current_time_ms();
+    uint64_t ct = maintenance_now_ms();
+    if(a->last_pool_purge + POOL_PURGE_TIMEOUT < ct)
+    {
+        a->last_pool_purge = ct;
+        allocator_purge_idle(a, ct);
+    }
     // Try to release any local areas that are not in use.
     for(int32_t i = 0; i < ARENA_BIN_COUNT; i++){
         Queue* queue = &a->arenas[i];
@@ -1012,6 +1570,8 @@ bool allocator_release_local_areas(Allocator *a)
     
     // move all deferred back into the container
     allocator_release_deferred(a);
+    a->last_pool_purge = maintenance_now_ms();
+    allocator_purge_idle(a, a->last_pool_purge);
     int32_t active_count = 0;
     // Try to release all our arena blocks back to the partition allocator
     for(int32_t i = 0; i < ARENA_BIN_COUNT; i++){
@@ -1048,7 +1608,7 @@ int allocator_try_resize(void*p, const size_t s, size_t *os, bool zero)
         // the size is stored in the header.
         uint64_t *header = (uint64_t *)((uintptr_t)p - os_page_size);
         *os = *(header + 1);
-        if(*os <= s)
+        if(s <= *os)
         {
             // we can still use the old memory...
             return 1;
@@ -1105,7 +1665,7 @@ int allocator_try_resize(void*p, const size_t s, size_t *os, bool zero)
                     case SLOT_IMPLICIT:
                     {
                         *os = implicitList_get_block_size(p);
-                        if(*os <= s)
+                        if(s <= *os)
                         {
                             // we are still fitting within the old block.
                             return 1;
@@ -1135,7 +1695,7 @@ int allocator_try_resize(void*p, const size_t s, size_t *os, bool zero)
                         }
                         else // we are in a pool
                         {
-                            Pool* p = (Pool*)h;
+                            Pool* p = (Pool*)((uintptr_t)h + idx*c_size);
                             *os = p->block_size;
                             return 0;
                         }
@@ -1144,7 +1704,7 @@ int allocator_try_resize(void*p, const size_t s, size_t *os, bool zero)
                 case SLOT_IMPLICIT:
                     {
                         *os = implicitList_get_block_size(p);
-                        if(*os <= s)
+                        if(s <= *os)
                         {
                             // we are still fitting within the old block.
                             return 1;
@@ -1160,7 +1720,198 @@ int allocator_try_resize(void*p, const size_t s, size_t *os, bool zero)
     return 0;
 }
 
-size_t allocator_get_size(void *p)
+static inline size_t allocator_resize_os(void *p, size_t min_size, size_t preferred_size, bool shrink)
+{
+    // the size of the mapping is stored in the header, page included.
+    uint64_t *header = (uint64_t *)((uintptr_t)p - os_page_size);
+    size_t size = *(header + 1);
+    size_t usable = size - os_page_size;
+    size_t new_size = ALIGN_UP_2(preferred_size + os_page_size, os_page_size);
+    if(shrink)
+    {
+        // give back the pages we don't need.
+        if(new_size < size && shrink_memory(header, size, new_size))
+        {
+            *(header + 1) = new_size;
+            return new_size - os_page_size;
+        }
+        return usable;
+    }
+    if(preferred_size <= usable)
+    {
+        return usable;
+    }
+    if(!extend_memory(header, size, new_size))
+    {
+        if(min_size <= usable)
+        {
+            return usable;
+        }
+        new_size = ALIGN_UP_2(min_size + os_page_size, os_page_size);
+        if(!extend_memory(header, size, new_size))
+        {
+            return 0;
+        }
+    }
+    *(header + 1) = new_size;
+    return new_size - os_page_size;
+}
+
+static inline size_t allocator_resize_arena(Allocator *a, Arena *h, int32_t idx, size_t min_size, size_t preferred_size, bool shrink)
+{
+    uint32_t c_exp = ARENA_CHUNK_SIZE_EXPONENT(h->partition_id);
+    uint32_t range = get_range((uint32_t)idx, atomic_load(&h->ranges));
+    size_t usable = (size_t)range << c_exp;
+    size_t max_size = (size_t)(64 - idx) << c_exp;
+    if(min_size > max_size)
+    {
+        return 0;
+    }
+    if(preferred_size > max_size)
+    {
+        preferred_size = max_size;
+    }
+    if(!shrink && preferred_size <= usable)
+    {
+        return usable;
+    }
+    // only the owning thread changes the extents of its arena.
+    if((uintptr_t)atomic_load(&h->thread_id) != a->thread_id)
+    {
+        return (shrink || min_size <= usable) ? usable : 0;
+    }
+    if(shrink)
+    {
+        arena_shrink(h, idx, preferred_size);
+    }
+    else
+    {
+        // the contiguous slot might be handing out the chunks we want,
+        // so we settle it before looking at the in_use mask.
+        if(a->c_slot.header == (uintptr_t)h)
+        {
+            allocator_release_slot(a);
+        }
+        if(!arena_reallocate(h, idx, (int32_t)preferred_size, false))
+        {
+            if(min_size > usable && !arena_reallocate(h, idx, (int32_t)min_size, false))
+            {
+                return 0;
+            }
+        }
+    }
+    range = get_range((uint32_t)idx, atomic_load(&h->ranges));
+    return (size_t)range << c_exp;
+}
+
+static inline size_t allocator_resize_implicit(Allocator *a, ImplicitList *h, void *p, size_t min_size, size_t preferred_size, bool shrink)
+{
+    size_t usable = implicitList_get_block_size(p) - HEADER_OVERHEAD;
+    if(min_size > h->total_memory)
+    {
+        return 0;
+    }
+    if(preferred_size > h->total_memory)
+    {
+        preferred_size = h->total_memory;
+    }
+    if(!shrink && preferred_size <= usable)
+    {
+        return usable;
+    }
+    // the boundary tags are only touched by the owning thread.
+    if((uintptr_t)atomic_load(&h->thread_id) != a->thread_id)
+    {
+        return (shrink || min_size <= usable) ? usable : 0;
+    }
+    if(shrink)
+    {
+        implicitList_shrink_block(h, p, (int32_t)preferred_size);
+    }
+    else if(!implicitList_resize_block(h, p, (int32_t)preferred_size))
+    {
+        if(min_size > usable && !implicitList_resize_block(h, p, (int32_t)min_size))
+        {
+            return 0;
+        }
+    }
+    return implicitList_get_block_size(p) - HEADER_OVERHEAD;
+}
+
+//
+// Resize a block without ever moving it. When growing, the block ends up
+// holding at least min_size bytes and as close to preferred_size as the
+// container allows. When shrinking, the tail past preferred_size is handed
+// back to the container if it can be split off.
+// Returns the usable size of the block, or 0 if min_size could not be met.
+//
+static size_t allocator_resize_in_place(Allocator *a, void *p, size_t min_size, size_t preferred_size, bool shrink)
+{
+    if (p == NULL) {
+        return 0;
+    }
+    if((uintptr_t)p > BASE_OS_ALLOC_ADDRESS && (uintptr_t)p < OS_ALLOC_END)
+    {
+        return allocator_resize_os(p, min_size, preferred_size, shrink);
+    }
+    
+    int32_t pid = partition_id_from_addr((uintptr_t)p);
+    if (pid < 0 || pid >= PARTITION_COUNT) {
+        return 0;
+    }
+    size_t area_size = region_size_from_partition_id(pid);
+    uint32_t c_exp = ARENA_CHUNK_SIZE_EXPONENT(pid);
+    uint64_t c_size = ARENA_CHUNK_SIZE(pid);
+    Arena* h =  (Arena*)ALIGN_DOWN_2(p, area_size);
+    
+    int32_t idx = delta_exp_to_idx((uintptr_t)p, (uintptr_t)h, c_exp);
+    bool top_aligned = ((uintptr_t)p & (c_size - 1)) == 0;
+    size_t usable = 0;
+    if(idx == 0 && top_aligned)
+    {
+        // a whole region handed out by the partition allocator.
+        usable = area_size;
+    }
+    else
+    {
+        slot_type st = get_base_type((alloc_base*)h);
+        switch (st) {
+            case SLOT_ARENA:
+            {
+                if(top_aligned)
+                {
+                    return allocator_resize_arena(a, h, idx, min_size, preferred_size, shrink);
+                }
+                // pools hand out fixed size blocks.
+                Pool* pool = idx == 0 ? (Pool*)ALIGN_CACHE((uintptr_t)h + sizeof(Arena))
+                                      : (Pool*)((uintptr_t)h + idx*c_size);
+                usable = pool->block_size;
+                break;
+            }
+            case SLOT_IMPLICIT:
+                return allocator_resize_implicit(a, (ImplicitList*)h, p, min_size, preferred_size, shrink);
+            default:
+                return 0;
+        }
+    }
+    return (shrink || min_size <= usable) ? usable : 0;
+}
+
+size_t allocator_expand(Allocator *a, void *p, size_t min_size, size_t preferred_size)
+{
+    if(preferred_size < min_size)
+    {
+        preferred_size = min_size;
+    }
+    return allocator_resize_in_place(a, p, min_size, preferred_size, false);
+}
+
+size_t allocator_shrink(Allocator *a, void *p, size_t new_size)
+{
+    return allocator_resize_in_place(a, p, 0, new_size, true);
+}
+
+size_t allocator_get_size(Allocator *a, void *p)
 {
     if (p == NULL) {
         return 0;
@@ -1168,9 +1919,9 @@ size_t allocator_get_size(void *p)
     if((uintptr_t)p > BASE_OS_ALLOC_ADDRESS && (uintptr_t)p < OS_ALLOC_END)
     {
         // this is a memory that was allocated by the OS.
-        // the size is stored in the header.
+        // the size is stored in the header, header page included.
         uint64_t *header = (uint64_t *)((uintptr_t)p - os_page_size);
-        return *(header + 1);
+        return *(header + 1) - os_page_size;
     }
     int32_t pid = partition_id_from_addr((uintptr_t)p);
     if (pid >= 0 && pid < PARTITION_COUNT) {
@@ -1180,67 +1931,43 @@ size_t allocator_get_size(void *p)
         // If the address is not aligned to the region size, we cannot use it.
         uint32_t c_exp = ARENA_CHUNK_SIZE_EXPONENT(pid);
         uint64_t c_size = ARENA_CHUNK_SIZE(pid);
-        // c_size is the size of the chunk in bytes.
-        uint64_t a_size = c_size * 64;
         // If the address is not aligned to the chunk size, we cannot use it.
         Arena* h =  (Arena*)ALIGN_DOWN_2(p, area_size);
         
         int32_t idx = delta_exp_to_idx((uintptr_t)p, (uintptr_t)h, c_exp);
-        slot_type st = get_base_type((alloc_base*)h);
         bool top_aligned = ((uintptr_t)p & (c_size - 1)) == 0;
-        if(idx == 0)
+        if(idx == 0 && top_aligned)
         {
-            if(top_aligned)
-            {
-                // the address is aligned to the chunk size.
-                return a_size;
-            }
-            else
+            // a whole region handed out by the partition allocator.
+            return area_size;
+        }
+        slot_type st = get_base_type((alloc_base*)h);
+        switch (st) {
+            case SLOT_ARENA:
             {
-                // this could be a pool or an implicit list.
-                switch (st) {
-                    case SLOT_ARENA:
-                    {
-                        // Pools are stored in arenas.
-                        // the first pool slot is offset by the arena header.
-                        Pool* p = (Pool*)ALIGN_CACHE((uintptr_t)h + sizeof(Arena));
-                        return p->block_size;
-                    }
-                    case SLOT_IMPLICIT:
+                if(top_aligned)
+                {
+                    // chunks that still sit in our contiguous slot
+                    // have not had their extents written yet.
+                    uintptr_t offset = (uintptr_t)p - (uintptr_t)h;
+                    if(a->c_slot.type == SLOT_ARENA && a->c_slot.header == (uintptr_t)h &&
+                       offset >= (uintptr_t)a->c_slot.start && offset < (uintptr_t)a->c_slot.offset)
                     {
-                        return implicitList_get_block_size(p);
+                        return a->c_slot.req_size;
                     }
-                    default:
-                        return 0;   
+                    uint32_t range = get_range((uint32_t)idx, atomic_load(&h->ranges));
+                    return (size_t)range << c_exp;
                 }
+                // Pools are stored in arenas.
+                // the first pool slot is offset by the arena header.
+                Pool* pool = idx == 0 ? (Pool*)ALIGN_CACHE((uintptr_t)h + sizeof(Arena))
+                                      : (Pool*)((uintptr_t)h + idx*c_size);
+                return pool->block_size;
             }
-        }
-        else
-        {
-            switch (st) {
-                case SLOT_ARENA:
-                    {
-                        // we are in an arena.
-                        if(top_aligned)
-                        {
-                            // the address is aligned to the chunk size.
-                            return a_size;
-                        }
-                        else // we are in a pool
-                        {
-                            Pool* p = (Pool*)h;
-                            return p->block_size;
-                        }
-                    }
-                    break;
-                case SLOT_IMPLICIT:
-                    {
-                        return implicitList_get_block_size(p);
-                    }
-                    break;
-                default:
-                    return 0;
-            }
+            case SLOT_IMPLICIT:
+                return implicitList_get_block_size(p) - HEADER_OVERHEAD;
+            default:
+                return 0;
         }
     }
     return 0;
@@ -6,10 +6,19 @@
 typedef void* (*internal_alloc) (Allocator *a, const size_t as);
 Allocator *allocator_aquire(uintptr_t thread_id, uintptr_t thr_mem);
 void *allocator_malloc(const Allocator_param *prm);
+void allocator_zero_stats(Allocator *a, size_t *zeroed, size_t *fresh);
 bool allocator_release_local_areas(Allocator *a);
 void allocator_free(Allocator *a, void *p);
-size_t allocator_get_size(void *p);
+size_t allocator_get_size(Allocator *a, void *p);
+size_t allocator_good_size(size_t size);
 int allocator_try_resize(void*p, const size_t s, size_t *os, bool zero);
+size_t allocator_expand(Allocator *a, void *p, size_t min_size, size_t preferred_size);
+size_t allocator_shrink(Allocator *a, void *p, size_t new_size);
 bool allocator_try_release_local_area(Allocator* alloc, int32_t partition_id);
+void allocator_trim_empty_pools(Allocator *a, uint32_t block_idx);
+size_t allocator_age_idle(Allocator *a, uint64_t now);
+// take over an arena or implicit list a dead thread abandoned and file it
+// in this allocator's queues. false when another thread got it first.
+bool allocator_adopt(Allocator *a, void *region);
 
 #endif /* ALLOCATOR_H */
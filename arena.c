@@ -1,6 +1,29 @@
 #include "arena.h"
 #include "pool.h"
 #include "partition_allocator.h"
+#include "maintenance.h"
+
+// Freed chunks have been touched, their idle time starts over.
+static inline void arena_mark_dirty(Arena *a, uint64_t mask)
+{
+    atomic_fetch_and_explicit(&a->idle, ~mask, memory_order_relaxed);
+    atomic_fetch_and_explicit(&a->purged, ~mask, memory_order_relaxed);
+    atomic_fetch_and_explicit(&a->cold, ~mask, memory_order_relaxed);
+    atomic_fetch_and_explicit(&a->paged, ~mask, memory_order_relaxed);
+}
+
+// how long chunks in use can go without allocator activity before they are
+// advised cold or paged out. 0 turns a step off.
+bool arena_aging = false;
+static uint64_t arena_cold_ms = 0;
+static uint64_t arena_pageout_ms = 0;
+
+void arena_set_aging(uint64_t cold_ms, uint64_t pageout_ms)
+{
+    arena_cold_ms = cold_ms;
+    arena_pageout_ms = pageout_ms;
+    arena_aging = cold_ms != 0 || pageout_ms != 0;
+}
 
 void arena_allocate_blocks(Allocator* alloc, Arena *a, int start_bit, int size_in_blocks) {
     // Clear area_mask bits.
@@ -50,9 +73,10 @@ void arena_unuse_blocks(Arena *a, int start_bit)
     atomic_fetch_and_explicit(&a->zero,
                               ~area_clear_mask,
                               memory_order_release);
+    arena_mark_dirty(a, area_clear_mask);
     if(a->in_use <= 1)
     {
-        a->last_used = current_time_ms();
+        a->last_used = maintenance_now_ms();
     }
 }
 
@@ -92,6 +116,7 @@ void arena_free_blocks(Allocator* alloc, Arena *a, int start_bit) {
     atomic_fetch_and_explicit(&a->zero,
                               ~area_clear_mask,
                               memory_order_release);
+    arena_mark_dirty(a, area_clear_mask);
     // Clear range_mask bits if needed.
     if (size_in_blocks > 1) {
         uint64_t range_clear_mask = (1ULL << start_bit) | (1ULL << (start_bit + size_in_blocks - 1));
@@ -109,7 +134,7 @@ void arena_free_blocks(Allocator* alloc, Arena *a, int start_bit) {
     }
 }
 
-void arena_clear_dirty(Arena *a)
+void arena_clear_dirty(Allocator* alloc, Arena *a)
 {
     // for every dirty block, we clear the dirty bit.  
     uint32_t c_size = (uint32_t)ARENA_CHUNK_SIZE(a->partition_id);
@@ -119,10 +144,19 @@ void arena_clear_dirty(Arena *a)
         uint64_t new_mask = 0ULL;
         if(atomic_compare_exchange_strong(&a->dirty, &dirty, new_mask))
         {
+            // chunks that are no longer pools have nothing to claim.
+            dirty &= atomic_load(&a->active);
             int32_t chunk_idx = get_next_mask_idx(dirty, 0);
             while (chunk_idx != -1) {
                 Pool* pool = (Pool*)((uintptr_t)a + (chunk_idx * c_size));
                 pool_claim_thread_frees(pool);
+                if(pool_is_unused(pool))
+                {
+                    pool_set_unused(pool);
+                }
+                // pools filed as full are never searched, refile them now
+                // that other threads handed blocks back.
+                pool_rebin(alloc, pool);
                 chunk_idx = get_next_mask_idx(dirty, chunk_idx + 1);
             }
         }
@@ -136,7 +170,7 @@ bool arena_free_active(Allocator* alloc, Arena *a, bool decommit)
     uint32_t c_size = (uint32_t)ARENA_CHUNK_SIZE(a->partition_id);
     uint64_t in_use = atomic_load(&a->in_use);
     uint64_t active = atomic_load(&a->active);
-    if(in_use <= 1 && active != 0)
+    if(in_use <= 1)
     {   
         uint64_t new_mask = 0ULL;
         if(atomic_compare_exchange_strong(&a->active, &active, new_mask))
@@ -144,8 +178,10 @@ bool arena_free_active(Allocator* alloc, Arena *a, bool decommit)
             int32_t chunk_idx = get_next_mask_idx(active, 0);
             while (chunk_idx != -1) {
                 Pool* pool = (Pool*)((uintptr_t)a + (chunk_idx * c_size));
-                Queue* pqueue = &alloc->pools[pool->block_idx];
-                list_remove(pqueue, pool);
+                if(pool_is_queued(alloc, pool))
+                {
+                    list_remove(pool_queue(alloc, pool), pool);
+                }
                 chunk_idx = get_next_mask_idx(active, chunk_idx + 1);
             }
             Queue*aqueue = &alloc->arenas[a->partition_id];
@@ -162,7 +198,8 @@ bool arena_reallocate(Arena *a, int32_t start_idx, int32_t new_size, bool zero)
 {
     // how many blocks does the new_size need
     int32_t aexp = ARENA_CHUNK_SIZE_EXPONENT( a->partition_id);
-    int32_t range = get_range(start_idx, a->ranges);
+    uint64_t ranges = atomic_load(&a->ranges);
+    int32_t range = get_range(start_idx, ranges);
     
     // divide by the exponent to get the number of blocks
     int32_t num_blocks = new_size >> aexp;
@@ -174,31 +211,161 @@ bool arena_reallocate(Arena *a, int32_t start_idx, int32_t new_size, bool zero)
     }
     // Compute the number of additional blocks needed
     int32_t additional_blocks = num_blocks - range;
-    uint64_t ranges = atomic_load(&a->ranges);
+    if (additional_blocks <= 0) {
+        // already large enough
+        return true;
+    }
+    if (start_idx + num_blocks > 64) {
+        // we would run off the end of the arena
+        return false;
+    }
     uint64_t in_use = atomic_load(&a->in_use);
     uint64_t zeros = atomic_load(&a->zero);
-    if (additional_blocks > 0) {
-        // we need to check if the blocks after the start idx and range
-        uint64_t new_block_mask = ((1ULL << additional_blocks) - 1) << (start_idx + range);
-        if ((in_use & new_block_mask) == 0) {
-            if(zero)
-            {
-                // if we are zeroing, we need to check if the blocks are zeroed
-                if ((zeros & new_block_mask) != new_block_mask) {
-                    // we can't allocate zeroed memory
-                    return false;
-                }
-            }
-            // If the region is free, we can allocate it
-            atomic_fetch_or(&a->in_use, new_block_mask);
-            // update the range ... 
-            // first we need to clear it.
-            ranges &= ~new_block_mask;
-            uint64_t new_range = apply_range(num_blocks, start_idx);
-            atomic_fetch_or(&a->ranges, new_range);
+    // we need to check if the blocks after the start idx and range
+    uint64_t new_block_mask = ((1ULL << additional_blocks) - 1) << (start_idx + range);
+    if ((in_use & new_block_mask) != 0) {
+        return false;
+    }
+    if(zero)
+    {
+        // if we are zeroing, we need to check if the blocks are zeroed
+        if ((zeros & new_block_mask) != new_block_mask) {
+            // we can't allocate zeroed memory
+            return false;
+        }
+    }
+    // If the region is free, we can allocate it
+    if (!atomic_compare_exchange_strong(&a->in_use, &in_use, in_use | new_block_mask)) {
+        return false;
+    }
+    if (!arena_commit_to(a, (uint64_t)(start_idx + num_blocks) << aexp)) {
+        atomic_fetch_and(&a->in_use, ~new_block_mask);
+        return false;
+    }
+    // update the range ... 
+    // first we need to clear the old extents.
+    atomic_fetch_and(&a->ranges, ~apply_range(range, start_idx));
+    atomic_fetch_or(&a->ranges, apply_range(num_blocks, start_idx));
 
-            return true;
+    return true;
+}
+
+bool arena_shrink(Arena *a, int32_t start_idx, size_t new_size)
+{
+    int32_t aexp = ARENA_CHUNK_SIZE_EXPONENT(a->partition_id);
+    uint64_t ranges = atomic_load(&a->ranges);
+    int32_t range = get_range(start_idx, ranges);
+    
+    // we always keep the first block
+    int32_t num_blocks = (int32_t)((new_size + ((1ULL << aexp) - 1)) >> aexp);
+    if (num_blocks == 0) {
+        num_blocks = 1;
+    }
+    if (num_blocks >= range) {
+        return false;
+    }
+    
+    // the tail blocks go back to the arena
+    uint64_t release_mask = ((1ULL << (range - num_blocks)) - 1) << (start_idx + num_blocks);
+    atomic_fetch_and(&a->ranges, ~apply_range(range, start_idx));
+    atomic_fetch_or(&a->ranges, apply_range(num_blocks, start_idx));
+    atomic_fetch_and_explicit(&a->in_use,
+                              ~release_mask,
+                              memory_order_release);
+    // these are not guarenteed zero anymore
+    atomic_fetch_and_explicit(&a->zero,
+                              ~release_mask,
+                              memory_order_release);
+    arena_mark_dirty(a, release_mask);
+    return true;
+}
+
+// Advise the kernel about chunks that hold live data the allocator hasn't
+// touched in a while, so it reclaims them before the hot ones.
+size_t arena_age_idle(Arena *a, uint64_t now, uint64_t exclude)
+{
+    if (!arena_aging) {
+        return 0;
+    }
+    uint32_t stamp = (uint32_t)(now >> ARENA_AGE_SHIFT);
+    uint64_t in_use = atomic_load(&a->in_use) & ~(exclude | 1ULL);
+    uint64_t cold = atomic_load(&a->cold);
+    uint64_t paged = atomic_load(&a->paged);
+    uint64_t to_cold = 0;
+    uint64_t to_page = 0;
+    uint64_t rest = in_use;
+    while (rest != 0) {
+        uint32_t i = __builtin_ctzll(rest);
+        uint64_t bit = 1ULL << i;
+        uint64_t idle_ms = (uint64_t)(uint32_t)(stamp - a->touched[i]) << ARENA_AGE_SHIFT;
+        if (arena_pageout_ms != 0 && idle_ms >= arena_pageout_ms && (paged & bit) == 0) {
+            to_page |= bit;
+        } else if (arena_cold_ms != 0 && idle_ms >= arena_cold_ms && (cold & bit) == 0) {
+            to_cold |= bit;
         }
+        rest &= rest - 1;
     }
-    return false;
+    uint64_t chunk_size = ARENA_CHUNK_SIZE(a->partition_id);
+    size_t aged = 0;
+    uint64_t masks[2] = {to_cold, to_page};
+    for (int m = 0; m < 2; m++) {
+        rest = masks[m];
+        while (rest != 0) {
+            uint32_t start = __builtin_ctzll(rest);
+            uint64_t tail = ~(rest >> start);
+            uint32_t len = tail == 0 ? 64 - start : (uint32_t)__builtin_ctzll(tail);
+            uint64_t run = (len == 64 ? ~0ULL : ((1ULL << len) - 1)) << start;
+            advise_cold((uint8_t*)a + start * chunk_size, len * chunk_size, m == 1);
+            aged += len * chunk_size;
+            rest &= ~run;
+        }
+    }
+    atomic_fetch_or_explicit(&a->cold, to_cold | to_page, memory_order_relaxed);
+    atomic_fetch_or_explicit(&a->paged, to_page, memory_order_relaxed);
+    return aged;
+}
+
+// Give back the pages of chunks that have been neither in use nor active
+// for a whole decay interval. exclude holds chunks the owner still hands
+// out from without marking them. Owner thread only.
+size_t arena_purge_idle(Arena *a, uint64_t now, uint64_t exclude)
+{
+    if (now - a->idle_since < ARENA_CHUNK_DECAY) {
+        return 0;
+    }
+    uint64_t in_use = atomic_load(&a->in_use);
+    uint64_t purged = atomic_load(&a->purged);
+    // the first chunk holds the header.
+    uint64_t free_chunks = ~(in_use | atomic_load(&a->active) | exclude | 1ULL);
+    uint64_t chunk_size = ARENA_CHUNK_SIZE(a->partition_id);
+    size_t granule = partition_allocator_purge_granule((int32_t)a->partition_id);
+    uint32_t per = granule > chunk_size ? (uint32_t)(granule / chunk_size) : 1;
+    uint64_t purge = mask_whole_groups(atomic_load(&a->idle) & free_chunks, per) & ~purged;
+    // hold the chunks while their pages go, so a resize can't grow into them.
+    if (purge != 0 && !atomic_compare_exchange_strong(&a->in_use, &in_use, in_use | purge)) {
+        return 0;
+    }
+    size_t released = 0;
+    uint64_t zeroed = 0;
+    uint64_t rest = purge;
+    while (rest != 0) {
+        uint32_t start = __builtin_ctzll(rest);
+        uint64_t tail = ~(rest >> start);
+        uint32_t len = tail == 0 ? 64 - start : (uint32_t)__builtin_ctzll(tail);
+        uint64_t run = (len == 64 ? ~0ULL : ((1ULL << len) - 1)) << start;
+        if (partition_allocator_purge_pages((uint8_t*)a + start * chunk_size, len * chunk_size)) {
+            zeroed |= run;
+        }
+        released += len * chunk_size;
+        rest &= ~run;
+    }
+    if (purge != 0) {
+        atomic_fetch_or_explicit(&a->purged, purge, memory_order_relaxed);
+        atomic_fetch_or_explicit(&a->zero, zeroed, memory_order_release);
+        atomic_fetch_and_explicit(&a->in_use, ~purge, memory_order_release);
+    }
+    // the next interval starts from what is free and still dirty now.
+    atomic_store_explicit(&a->idle, free_chunks & ~(purged | purge), memory_order_relaxed);
+    a->idle_since = now;
+    return released;
 }
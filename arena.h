@@ -11,6 +11,8 @@
     * 
 */
 #include "callocator.inl"
+#include "maintenance.h"
+#include "partition_allocator.h"
 
 // Arena structure definition
 #define ARENA_BASE_SIZE_EXPONENT 22
@@ -42,7 +44,36 @@ void arena_free_blocks(Allocator* alloc, Arena *a, int start_bit);
 void arena_unuse_blocks(Arena *a, int start_bit);
 void arena_use_blocks(Arena *a, int start_bit);
 void arena_set_dirty_blocks(Arena *a, int start_bit);
-void arena_clear_dirty(Arena *a);
+void arena_clear_dirty(Allocator* alloc, Arena *a);
 bool arena_free_active(Allocator* alloc, Arena *a, bool decommit);
 bool arena_reallocate(Arena *a, int32_t start_idx, int32_t size_in_blocks, bool zero);
+bool arena_shrink(Arena *a, int32_t start_idx, size_t new_size);
+size_t arena_purge_idle(Arena *a, uint64_t now, uint64_t exclude);
+size_t arena_age_idle(Arena *a, uint64_t now, uint64_t exclude);
+void arena_set_aging(uint64_t cold_ms, uint64_t pageout_ms);
+
+extern bool arena_aging;
+
+// make the arena writable up to end bytes from its header.
+static inline bool arena_commit_to(Arena *a, uint64_t end)
+{
+    return end <= atomic_load_explicit(&a->commit_end, memory_order_relaxed) ||
+           partition_allocator_commit_to(a, &a->commit_end, end);
+}
+
+// the allocator handed out or took back memory in these chunks.
+static inline void arena_touch(Arena *a, uint64_t mask)
+{
+    // stamped with aging off too, so turning it on later sees real ages.
+    uint32_t now = (uint32_t)(maintenance_now_ms() >> ARENA_AGE_SHIFT);
+    uint64_t rest = mask;
+    while (rest != 0) {
+        a->touched[__builtin_ctzll(rest)] = now;
+        rest &= rest - 1;
+    }
+    if ((atomic_load_explicit(&a->cold, memory_order_relaxed) & mask) != 0) {
+        atomic_fetch_and_explicit(&a->cold, ~mask, memory_order_relaxed);
+        atomic_fetch_and_explicit(&a->paged, ~mask, memory_order_relaxed);
+    }
+}
 #endif // ARENA_H
@@ -4,7 +4,11 @@
 #include "os.h"
 #include "partition_allocator.h"
 #include "implicit_list.h"
+#include "memops.h"
+#include "maintenance.h"
+#include "pool.h"
 #include <stdatomic.h>
+#include <stdio.h>
 
 extern PartitionAllocator *partition_allocator;
 static _Atomic(size_t) num_threads = (1);
@@ -26,13 +30,15 @@ cache_align Allocator *main_instance;
 
 __thread Allocator *thread_instance = NULL;
 static tls_t _thread_key = (tls_t)(-1);
-#define MAIN_ALLOCATOR_SIZE (sizeof(Allocator) + sizeof(Queue) * (POOL_BIN_COUNT + PARTITION_COUNT + ARENA_BIN_COUNT))
-static uint8_t main_allocator_buffer[MAIN_ALLOCATOR_SIZE] __attribute__((aligned(64)));
+static uint8_t main_allocator_buffer[ALLOCATOR_MEMORY_SIZE] __attribute__((aligned(64)));
 
 static void allocator_thread_detach(Allocator* alloc)
 {
+    // hand back what the slot and the free batch hold, or the pools and
+    // arenas we abandon count blocks as used that nobody will ever free.
+    allocator_release_local_areas(alloc);
     // disconnect all the pools.
-    for (int i = 0; i < POOL_BIN_COUNT; i++) {
+    for (int i = 0; i < POOL_QUEUE_COUNT; i++) {
         Queue* queue = &alloc->pools[i];
         Pool* start = queue->head;
         while (start) {
@@ -99,14 +105,14 @@ static void thread_done(void *a)
     if (a != NULL) {
         Allocator *alloc = (Allocator *)a;
         allocator_thread_detach(alloc);
-        free_memory(alloc, os_page_size);
+        free_memory(alloc, ALIGN_UP_2(ALLOCATOR_MEMORY_SIZE, os_page_size));
         decr_thread_count();
     }
 }
 
 static Allocator *init_thread_instance(uintptr_t tid)
 {
-    uintptr_t thr_mem = (uintptr_t)alloc_memory((void*)BASE_OS_ALLOC_ADDRESS, os_page_size, true);
+    uintptr_t thr_mem = (uintptr_t)alloc_memory((void*)BASE_OS_ALLOC_ADDRESS, ALIGN_UP_2(ALLOCATOR_MEMORY_SIZE, os_page_size), true);
     Allocator *new_alloc = allocator_aquire(tid, thr_mem);
     
     thread_instance = new_alloc;
@@ -164,6 +170,7 @@ static int allocator_init(void)
 
     main_thread_id = get_thread_id();
     os_page_size = get_os_page_size();
+    memops_init();
     tls_create(&_thread_key, &thread_done);
     
     partition_allocator = partition_allocator__create();
@@ -274,6 +281,11 @@ extern inline void __attribute__((malloc)) *zalloc( size_t num, size_t size )
     return allocator_malloc(&params);
 }
 
+void callocator_zero_stats(size_t *zeroed, size_t *fresh)
+{
+    allocator_zero_stats(get_thread_instance(), zeroed, fresh);
+}
+
 extern inline void cfree(void *p)
 {
     if(p == NULL)
@@ -333,6 +345,52 @@ bool callocator_release(void)
     return allocator_release_local_areas(alloc);
 }
 
+size_t cexpand(void *p, size_t min_size, size_t preferred_size)
+{
+    if(p == NULL || min_size == 0)
+    {
+        return 0;
+    }
+    return allocator_expand(get_thread_instance(), p, min_size, preferred_size);
+}
+
+size_t cshrink(void *p, size_t new_size)
+{
+    if(p == NULL)
+    {
+        return 0;
+    }
+    return allocator_shrink(get_thread_instance(), p, new_size);
+}
+
+size_t cmalloc_usable_size(void *p)
+{
+    if(p == NULL)
+    {
+        return 0;
+    }
+    return allocator_get_size(get_thread_instance(), p);
+}
+
+size_t cmalloc_good_size(size_t s)
+{
+    if(s == 0)
+    {
+        return 0;
+    }
+    return allocator_good_size(s);
+}
+
+void *cmalloc_at_least(size_t s, size_t *actual)
+{
+    void *p = _cmalloc(s, false);
+    if(actual != NULL)
+    {
+        *actual = p != NULL ? allocator_get_size(get_thread_instance(), p) : 0;
+    }
+    return p;
+}
+
 static inline void *_aligned_crealloc(void *p, size_t alignment, size_t s, bool zero )
 {
     
@@ -368,7 +426,7 @@ static inline void *_aligned_crealloc(void *p, size_t alignment, size_t s, bool
     }
     
     // we were not able to remap the memory
-    memcpy(new_ptr, p, old_size);
+    mem_copy(new_ptr, p, old_size);
     cfree(p);
     
     return new_ptr;
@@ -418,7 +476,7 @@ static inline void *_crealloc(void *p, size_t s, bool zero)
     }
     
     // we were not able to remap the memory
-    memcpy(new_ptr, p, old_size);
+    mem_copy(new_ptr, p, old_size);
     cfree(p);
     
     return new_ptr;
@@ -436,7 +494,9 @@ extern inline void __attribute__((malloc)) *zcrealloc(void *p, size_t s )
 
 // Allocating memory from the OS that will not conflict with any memory region
 // of the allocator.
-static _Atomic(uintptr_t) os_alloc_hint = BASE_OS_ALLOC_ADDRESS;
+// 0 until the first mapping, the layout may still move before that.
+static _Atomic(uintptr_t) os_alloc_hint = 0;
+static _Atomic(int64_t) os_mapping_count = 0;
 void *cmalloc_os(size_t size)
 {
     // align size to page size
@@ -460,6 +520,7 @@ void *cmalloc_os(size_t size)
         }
         
         atomic_store_explicit(&os_alloc_hint, alloc_hint, memory_order_relaxed);
+        atomic_fetch_add_explicit(&os_mapping_count, 1, memory_order_relaxed);
     }
     else
     {
@@ -491,5 +552,104 @@ void cfree_os(void* ptr)
         // invalid size, we cannot free this memory.
         return;
     }
-    free_memory((void *)header, size);
+    if (free_memory((void *)header, size)) {
+        atomic_fetch_sub_explicit(&os_mapping_count, 1, memory_order_relaxed);
+    }
+}
+
+void callocator_set_purge_mode(purge_mode mode, bool batched)
+{
+    partition_allocator_set_purge_mode(mode, batched);
+}
+
+void callocator_set_hugepages(hugepage_mode mode, size_t threshold)
+{
+    partition_allocator_set_hugepages(mode, threshold);
+}
+
+void callocator_set_placement(placement_policy policy)
+{
+    partition_allocator_set_placement(policy);
+}
+
+void callocator_set_commit_step(size_t step)
+{
+    partition_allocator_set_commit_step(step);
+}
+
+bool callocator_add_size_class(size_t size)
+{
+    return pool_add_size_class(size);
+}
+
+void callocator_profile_sizes(bool enable)
+{
+    pool_profiling = enable;
+}
+
+size_t callocator_suggest_size_classes(size_t *classes, size_t *saved, size_t max_classes)
+{
+    return pool_suggest_size_classes(classes, saved, max_classes);
+}
+
+void callocator_print_size_suggestions(size_t max_classes)
+{
+    size_t classes[POOL_CUSTOM_COUNT];
+    size_t saved[POOL_CUSTOM_COUNT];
+    size_t count = pool_suggest_size_classes(classes, saved, MIN(max_classes, POOL_CUSTOM_COUNT));
+    for (size_t i = 0; i < count; i++) {
+        fprintf(stderr, "callocator: size class %zu would save %zu bytes\n", classes[i], saved[i]);
+    }
+}
+
+void callocator_set_header_padding(bool pad)
+{
+    pool_set_header_padding(pad);
+}
+
+void callocator_set_aging(uint32_t cold_ms, uint32_t pageout_ms)
+{
+    arena_set_aging(cold_ms, pageout_ms);
+}
+
+size_t callocator_age_idle(void)
+{
+    Allocator *alloc = get_thread_instance();
+    return allocator_age_idle(alloc, maintenance_now_ms());
+}
+
+bool callocator_decommit_idle(void)
+{
+    return partition_allocator_decommit_pending(partition_allocator);
+}
+
+bool callocator_start_maintenance(uint32_t tick_ms, uint32_t decay_ms)
+{
+    return maintenance_start(tick_ms, decay_ms);
+}
+
+void callocator_stop_maintenance(void)
+{
+    maintenance_stop();
+}
+
+size_t callocator_vma_count(void)
+{
+    int64_t os_count = atomic_load_explicit(&os_mapping_count, memory_order_relaxed);
+    return partition_allocator_vma_count(partition_allocator) + (os_count < 0 ? 0 : (size_t)os_count);
+}
+
+bool callocator_set_layout(uintptr_t base, size_t partition_size)
+{
+    // os allocations already handed out have to stay inside the os range.
+    if (atomic_load_explicit(&os_mapping_count, memory_order_relaxed) != 0) {
+        return false;
+    }
+    return partition_allocator_set_layout(partition_allocator, base, partition_size);
+}
+
+void callocator_get_layout(uintptr_t *base, size_t *partition_size)
+{
+    *base = BASE_ADDRESS;
+    *partition_size = PARTITION_SIZE;
 }
@@ -17,6 +17,18 @@ void *cmalloc(size_t s);
 void cfree(void *p);
 
 void *crealloc(void *p, size_t s);
+// Resize in place only. The block is never moved, so these are safe for
+// data that can't be relocated with a memcpy.
+// cexpand returns the new usable size, or 0 if min_size can't be met in place.
+// cshrink returns the new usable size, which may be larger than new_size.
+size_t cexpand(void *p, size_t min_size, size_t preferred_size);
+size_t cshrink(void *p, size_t new_size);
+// Size queries. usable_size is what a live block can actually hold,
+// good_size is what a request of s bytes would be rounded up to.
+// cmalloc_at_least reports the usable size of the block it returns.
+size_t cmalloc_usable_size(void *p);
+size_t cmalloc_good_size(size_t s);
+void *cmalloc_at_least(size_t s, size_t *actual);
 void *caligned_alloc(size_t alignment, size_t size);
 void *caligned_realloc(size_t alignment, size_t size);
 bool callocator_release(void);
@@ -27,6 +39,93 @@ void *cmalloc_at(size_t s, uintptr_t vm_addr);
 
 void *zalloc( size_t num, size_t size ); // initilized to zero
 void *zaligned_alloc( size_t num, size_t size ); // initilized to zero
+// bytes the calling thread's zeroing allocations cleared by hand, and bytes
+// they skipped because the memory was known to be untouched since the os
+// zeroed it.
+void callocator_zero_stats(size_t *zeroed, size_t *fresh);
+// How released regions give their pages back.
+// PURGE_DECOMMIT drops the pages and the access rights.
+// PURGE_DONTNEED drops the pages but leaves the mapping writable.
+// PURGE_FREE lets the kernel take the pages lazily when it needs them.
+// batched hands a whole purge to process_madvise in one call where the
+// kernel supports it.
+typedef enum
+{
+    PURGE_DECOMMIT,
+    PURGE_DONTNEED,
+    PURGE_FREE,
+} purge_mode;
+void callocator_set_purge_mode(purge_mode mode, bool batched);
+// Huge pages for partition regions of at least threshold bytes.
+// HUGEPAGE_NONE leaves it to the system setting.
+// HUGEPAGE_ADVISE asks for transparent huge pages.
+// HUGEPAGE_EXPLICIT maps the regions from the hugetlb pool, and falls
+// back to HUGEPAGE_ADVISE when the pool isn't configured or runs dry.
+// Only regions committed after the call are affected.
+typedef enum
+{
+    HUGEPAGE_NONE,
+    HUGEPAGE_ADVISE,
+    HUGEPAGE_EXPLICIT,
+} hugepage_mode;
+void callocator_set_hugepages(hugepage_mode mode, size_t threshold);
+// Where new memory is carved from.
+// PLACEMENT_FIRST_FIT takes the first arena with room and the thread's
+// home block for regions.
+// PLACEMENT_ADDRESS_ORDERED takes the lowest arena, chunk and region with
+// room, so the high ones drain and can be released.
+typedef enum
+{
+    PLACEMENT_FIRST_FIT,
+    PLACEMENT_ADDRESS_ORDERED,
+} placement_policy;
+void callocator_set_placement(placement_policy policy);
+// Extra exact size classes, served by pools of their own. Sizes round up
+// to 8 bytes and go up to 32KB, at most 8 can be added. Register them at
+// init, classes can't be removed.
+bool callocator_add_size_class(size_t size);
+// Size profiling. While it is on, every request up to 32KB is counted.
+// suggest picks up to max_classes extra classes that cut the internal
+// fragmentation of the recorded requests the most, and the bytes each saves.
+void callocator_profile_sizes(bool enable);
+size_t callocator_suggest_size_classes(size_t *classes, size_t *saved, size_t max_classes);
+void callocator_print_size_suggestions(size_t max_classes);
+// Give pool headers a page of their own. Pools made after the call start
+// their blocks on the page after the header, at the cost of the padding.
+// The headers stay in-band: freed blocks still carry their free list link,
+// and arena and implicit list headers share pages with data as before.
+void callocator_set_header_padding(bool pad);
+// Aging of memory that is in use but idle. Arena chunks the allocator
+// hasn't handed out or taken back for cold_ms are advised MADV_COLD, and
+// after pageout_ms MADV_PAGEOUT, so the kernel reclaims them before the
+// hot ones. 0 turns a step off, both are off by default. The calling
+// thread's arenas are aged along with its purges, age_idle runs a pass
+// right away, e.g. on memory pressure, and returns the bytes it advised.
+void callocator_set_aging(uint32_t cold_ms, uint32_t pageout_ms);
+size_t callocator_age_idle(void);
+// Commit the regions of arenas and implicit lists a step at a time as
+// they fill up, instead of whole when they are handed out, so the commit
+// charge follows what is in use under strict overcommit accounting. The
+// step rounds up to a power of two pages, 0 (the default) commits whole
+// regions. Call it before the first allocation.
+void callocator_set_commit_step(size_t step);
+// drop the access rights of released regions that are still writable.
+// meant for memory that has left the hot set for good.
+bool callocator_decommit_idle(void);
+// Start a maintenance thread that does all the purging. Released memory
+// is given back along a decay curve over decay_ms, and the thread checks
+// every tick_ms. A decay of 0 purges on every tick.
+bool callocator_start_maintenance(uint32_t tick_ms, uint32_t decay_ms);
+void callocator_stop_maintenance(void);
+// estimate of the memory mappings the allocator holds, each one counts
+// against vm.max_map_count.
+size_t callocator_vma_count(void);
+// Place the partitions at base, each partition_size bytes (rounded up to
+// a power of two, 64GB to 1TB). Only works before the first allocation;
+// CALLOCATOR_BASE and CALLOCATOR_PARTITION_SIZE do the same from the
+// environment. When the range is taken a free one is picked further up.
+bool callocator_set_layout(uintptr_t base, size_t partition_size);
+void callocator_get_layout(uintptr_t *base, size_t *partition_size);
 
 
 
@@ -25,18 +25,52 @@ typedef SSIZE_T ssize_t;
 
 #define DEFAULT_OS_PAGE_SIZE 4096ULL
 #define ARENA_TIMEOUT 1000ULL  
+#define POOL_PURGE_TIMEOUT 1000ULL
+// empty pools a thread keeps per size class, scaled by how many pools the
+// class has taken lately.
+#define POOL_RETAIN_MIN 1
+#define POOL_RETAIN_MAX 16
+// a size class that took fewer pools than this since the last decay is
+// cold, its pools come from the smallest chunk that holds POOL_COLD_BLOCKS.
+#define POOL_WARM_DEMAND 2
+#define POOL_COLD_BLOCKS 8
+#define ARENA_CHUNK_DECAY 1000ULL
+// chunk activity is stamped in units of 1 << ARENA_AGE_SHIFT ms.
+#define ARENA_AGE_SHIFT 10
 #define PARTITION_COUNT 9
-#define BASE_ADDRESS (2ULL * 1024 * 1024 * 1024 * 1024) // 2TB
-#define BASE_OS_ALLOC_ADDRESS (12ULL * 1024 * 1024 * 1024 * 1024) // 12TB
-#define OS_ALLOC_END (BASE_OS_ALLOC_ADDRESS + BASE_ADDRESS) // 14TB
-
-#define PARTITION_SIZE_EXP (40) // 1TB
+#define DEFAULT_BASE_ADDRESS (2ULL * 1024 * 1024 * 1024 * 1024) // 2TB
+#define DEFAULT_PARTITION_SIZE_EXP (40) // 1TB
+// the largest partition has to hold at least one 64GB block.
+#define PARTITION_MIN_SIZE_EXP (36) // 64GB
+#define PARTITION_MAX_SIZE_EXP DEFAULT_PARTITION_SIZE_EXP
+
+// Where the partitions live. Picked once at init, from the environment
+// or callocator_set_layout, and only read after that.
+typedef struct
+{
+    uintptr_t base;
+    uintptr_t os_base;
+    uintptr_t os_end;
+    uint64_t size_exp;
+} PartitionLayout;
+extern PartitionLayout partition_layout;
+
+#define BASE_ADDRESS (partition_layout.base)
+#define BASE_OS_ALLOC_ADDRESS (partition_layout.os_base)
+#define OS_ALLOC_END (partition_layout.os_end)
+#define PARTITION_SIZE_EXP (partition_layout.size_exp)
 #define PARTITION_SIZE (1ULL << PARTITION_SIZE_EXP)
 #define PARTITION_SECTION_SIZE(x) (256 * 1024 * 1024 * (x + 1))
 #define BASE_REGION_SIZE (1ULL << 22ULL)
 
 #define ARENA_LEVELS 3
-#define POOL_BIN_COUNT 80
+#define POOL_FIXED_COUNT 80
+// slots for size classes registered at run time, after the fixed table.
+#define POOL_CUSTOM_COUNT 8
+#define POOL_BIN_COUNT (POOL_FIXED_COUNT + POOL_CUSTOM_COUNT)
+// every size class keeps its pools in occupancy bins, see pool_occupancy.
+#define POOL_OCCUPANCY_BINS 4
+#define POOL_QUEUE_COUNT (POOL_BIN_COUNT * POOL_OCCUPANCY_BINS)
 #define ARENA_SBIN_COUNT 7 // 1,2,4,8,16,32
 
 #define ARENA_BIN_COUNT PARTITION_COUNT
@@ -145,24 +179,28 @@ static inline uint64_t region_size_from_partition_id(uint8_t pid) { return BASE_
 
 static inline int32_t partition_id_from_addr(uintptr_t p) {
     
-    uintptr_t offset = p - BASE_ADDRESS;
-
-    // Check if the address is outside the allocator's range.
-    if (p < BASE_ADDRESS || offset >= (PARTITION_COUNT * PARTITION_SIZE)) {
-        return -1;  // Invalid address.
-    }
+    // addresses below the base wrap around to a huge offset.
+    uintptr_t pid = (p - BASE_ADDRESS) >> PARTITION_SIZE_EXP;
 
-    // Compute partition ID: offset / 64GiB.
-    return (int32_t)(offset / PARTITION_SIZE);
+    // -1 for anything outside the allocator's range.
+    int32_t outside = -(int32_t)(pid >= PARTITION_COUNT);
+    return (int32_t)pid | outside;
 }
 
 static inline uint64_t area_size_from_addr(uintptr_t p) { return region_size_from_partition_id(partition_id_from_addr(p)); }
 
 
+// Masks that are written on every region hand out and release.
+// Each block has a cache line of its own, so threads working on
+// neighbouring blocks don't invalidate each other.
 typedef struct {
-    _Atomic(uint64_t) reserved;     // which parts have been reserved.
     _Atomic(uint64_t) committed;    // which parts have committed virtual mem
-    _Atomic(uint64_t) ranges;       // the extends for each part.
+    
+    // these regions have been released and are pending reuse/decommit
+    _Atomic(uint64_t) pending_release;
+    
+    // When threads die, they mark their claimed regions as abandoned.
+    _Atomic(uint64_t)  abandoned;
     
     // When committed regions are used as arenas or implicit lists,
     // they are tagged as active.
@@ -170,22 +208,51 @@ typedef struct {
     // as a whole to the user application.
     _Atomic(uint64_t)  active;
     
-    // When threads die, they mark their claimed regions as abandoned.
-    _Atomic(uint64_t)  abandoned;
+    // these regions are mapped read/write, committed or not.
+    _Atomic(uint64_t) writable;
     
-    // these regions have been released and are pending reuse/decommit
-    _Atomic(uint64_t) pending_release;
+    // of the writable regions, these are only writable up to the commit
+    // mark of the arena or implicit list that owns them.
+    _Atomic(uint64_t) partial;
+    
+    uint8_t padding[CACHE_LINE - 6 * sizeof(uint64_t)];
 } PartitionMasks;
 
+// Masks that are mostly read once a block is in use, kept apart from the
+// hot ones and packed.
+typedef struct {
+    _Atomic(uint64_t) reserved;     // which parts have been reserved.
+    _Atomic(uint64_t) ranges;       // the extends for each part.
+} PartitionExtents;
+
 typedef struct {
     PartitionMasks* blocks; // Array of allocated blocks
+    PartitionExtents* extents;  // reserved/ranges for each block
     size_t num_blocks;
     size_t blockSize;          // Fixed block size for this partition
+    
+    // Summary of which blocks have no free region left.
+    // One bit per block, and one bit per summary word above that.
+    // Kept inverted so the zero pages the kernel hands us read as
+    // "everything free" without being written at init.
+    _Atomic(uint64_t)* full_blocks;
+    _Atomic(uint64_t) full_words;
+    // Summary of which blocks hold regions a dead thread left behind,
+    // laid out like the one above but not inverted.
+    _Atomic(uint64_t)* abandoned_blocks;
+    _Atomic(uint64_t) abandoned_words;
+    // the next home block to hand a thread.
+    _Atomic(uint32_t) next_home;
 } Partition;
 
 typedef struct {
     Partition partitions[PARTITION_COUNT];
     size_t totalMemory;        // Total memory managed by the allocator
+    // estimate of the mappings the partitions are split into.
+    _Atomic(int64_t) vma_count;
+    // bytes sitting in pending_release, and all bytes ever released.
+    _Atomic(int64_t) pending_bytes;
+    _Atomic(uint64_t) released_bytes;
 } PartitionAllocator;
 
 // linked list of free blocks
@@ -257,10 +324,22 @@ typedef struct Pool_t
     int32_t num_committed;
     int32_t num_available;
     uint32_t alignment;
-    int32_t is_zero; // is the pool zeroed?
+    int32_t zero_start; // blocks from here on have not been handed out since they were zeroed.
+    int32_t bin;        // occupancy bin of the size class queue the pool is filed under.
     Block* free;
+    uint64_t purged;    // 64ths of the pool whose pages were given back. No listed or used block touches them.
+    int32_t data_offset; // bytes from the header to the first block.
 } Pool;
 
+// pools are searched fullest first so sparse pools drain and come back whole.
+typedef enum pool_occupancy_t
+{
+    POOL_FULL,          // nothing to hand out, never searched.
+    POOL_MOSTLY_FULL,   // half or more of the blocks are in use.
+    POOL_MOSTLY_EMPTY,
+    POOL_EMPTY,         // no blocks in use.
+} pool_occupancy;
+
 
 
 typedef struct Arena_t
@@ -284,6 +363,13 @@ typedef struct Arena_t
     _Atomic(uint64_t)  zero;
 
     uint64_t last_used; // last time this arena was used.
+    _Atomic(uint64_t)  idle;     // free and untouched since the last purge sweep.
+    _Atomic(uint64_t)  purged;   // given back to the os since they were last freed.
+    uint64_t idle_since; // when the idle mask was taken.
+    _Atomic(uint64_t)  cold;     // in use, advised cold since they were last touched.
+    _Atomic(uint64_t)  paged;    // in use, paged out since they were last touched.
+    uint32_t touched[64]; // last allocator activity of each chunk, see ARENA_AGE_SHIFT.
+    _Atomic(uint64_t) commit_end; // bytes from the header that are writable.
     
 } Arena; 
 
@@ -308,7 +394,10 @@ typedef struct ImplicitList_t
     uint32_t max_block;    // what is the maximum size block available;
     uint32_t num_allocations;
     uint32_t is_zero; // is the implicit list zeroed?
+    uint32_t zero_offset; // nothing past this offset has been handed out.
+    uint32_t last_zero;   // the last block handed out was carved from untouched memory.
     Queue free_nodes;
+    _Atomic(uint64_t) commit_end; // bytes from the header that are writable.
 
 } ImplicitList;
 
@@ -341,7 +430,9 @@ typedef struct
     int32_t counter;    // the number of addresses handed out to users
     
     int32_t req_size;   // current requested size
-    int32_t is_zero;    //
+    int32_t is_zero;    // was zeroed memory requested
+    int32_t zero_offset;// contiguous memory from this offset on is known to be zero
+    int32_t recycled;   // the last block came off a free list, not the bump pointer
     slot_type type;     // the structure handing out the contigous blocks
 } alloc_slot_front;
 
@@ -399,8 +490,24 @@ typedef struct Allocator_t
     Queue *implicit;
 
     deferred_free c_deferred;  // release cache structure.
+    
+    // the partition block each partition search starts from.
+    int32_t home_block[PARTITION_COUNT];
+    uint64_t last_pool_purge;
+    // pools each size class took since the last decay.
+    uint8_t pool_demand[POOL_BIN_COUNT];
+    // bytes zalloc had to clear by hand, and bytes it could skip because the
+    // memory had not been touched since the os handed it over.
+    uint64_t zeroed_bytes;
+    uint64_t fresh_zero_bytes;
 } Allocator;
 
+// the allocator is followed by its pool, arena and implicit queues.
+#define ALLOCATOR_MEMORY_SIZE (ALIGN_CACHE(sizeof(Allocator)) +                \
+                               ALIGN_CACHE(sizeof(Queue) * POOL_QUEUE_COUNT) + \
+                               ALIGN_CACHE(sizeof(Queue) * PARTITION_COUNT) +  \
+                               sizeof(Queue) * ARENA_BIN_COUNT)
+
 typedef struct Allocator_param_t
 {
     uintptr_t thread_id;
@@ -579,12 +686,30 @@ static inline int32_t find_first_nones(uintptr_t x, int64_t n, int32_t exp) {
 }
 static inline int32_t get_next_mask_idx(uint64_t mask, uint32_t cidx)
 {
+    if (cidx > 63) {
+        return -1;
+    }
     uint64_t msk_cpy = mask >> cidx;
-    if (msk_cpy == 0 || (cidx > 63)) {
+    if (msk_cpy == 0) {
         return -1;
     }
     return __builtin_ctzll(msk_cpy) + cidx;
 }
+// The aligned groups of per bits that are all set in mask.
+static inline uint64_t mask_whole_groups(uint64_t mask, uint32_t per)
+{
+    if (per <= 1) {
+        return mask;
+    }
+    uint64_t group = per >= 64 ? ~0ULL : (1ULL << per) - 1;
+    uint64_t whole = 0;
+    for (uint32_t i = 0; i < 64; i += per) {
+        if (((mask >> i) & group) == group) {
+            whole |= group << i;
+        }
+    }
+    return whole;
+}
 static inline uint64_t apply_range(uint32_t range, uint32_t at)
 {
     if(range == 1)
@@ -5,6 +5,7 @@
 #include <stdatomic.h>
 #include "arena.h"
 #include "implicit_list.h"
+#include "allocator.h"
 
 /*
     When freeing memory, it is important that we can infer where the memory
@@ -38,9 +39,22 @@
  */
 extern PartitionAllocator *partition_allocator;
 
+static inline void deferred_reset(deferred_free* c)
+{
+    c->owned = false;
+    c->items.next = 0;
+    c->tail = 0;
+    c->start = UINT64_MAX;
+    c->end = 0;
+    c->num = 0;
+}
+
 // compute bounds and initialize
 void deferred_init(Allocator* a, void*p)
 {
+    // frees that don't start a batch return early, the last batch is
+    // released already and must not be released again.
+    deferred_reset(&a->c_deferred);
     int32_t pid = partition_id_from_addr((uintptr_t)p);
     if (pid >= 0 && pid < PARTITION_COUNT) {
         
@@ -59,10 +73,9 @@ void deferred_init(Allocator* a, void*p)
         // claim the arena if it is not claimed by a thread.
         if(thread_id == -1)
         {   
-            if(partition_allocator_claim_abandoned(partition_allocator, h))
+            if(allocator_adopt(a, h))
             {
-                // we can use this arena/implicit list.
-                atomic_store_explicit(&h->thread_id, a->thread_id, memory_order_release);
+                // we can use this arena/implicit list, it is in our queues now.
                 thread_id = a->thread_id;
             }
         }
@@ -174,22 +187,18 @@ void deferred_release(Allocator* a, void* p)
             {
                 
                 Pool *pool = (Pool*)c->start;
-                Queue* pqueue = &a->pools[pool->block_idx];
                 pool->num_used -= c->num;
+                pool_touch(pool);
                 if(pool_is_unused(pool))
                 {
                     // if the pool is unused, we can reset it.
                     pool_set_unused(pool);
-                    if(is_not_connected_to_list(pqueue,pool))
-                    {   
-                        // if the pool is not connected to the list, we add it to the list.
-                        list_enqueue(pqueue, pool);
-                    }
-                    else
-                    {
-                        // we move pools that have memory to the front.
-                        list_move_to_front(pqueue, pool);
-                    }
+                }
+                // the batch may have moved the pool to an emptier bin.
+                pool_rebin(a, pool);
+                if(pool->bin == POOL_EMPTY)
+                {
+                    allocator_trim_empty_pools(a, pool->block_idx);
                 }
             }
             else if(st ==  SLOT_IMPLICIT)
@@ -229,12 +238,7 @@ void deferred_release(Allocator* a, void* p)
         }
         else
         {
-            c->owned = false;
-            c->items.next = 0;
-            c->tail = 0;
-            c->start = UINT64_MAX;
-            c->end = 0;
-            c->num = 0;
+            deferred_reset(c);
         }
     }
 }
@@ -2,6 +2,8 @@
 
 
 #include "implicit_list.h"
+#include "partition_allocator.h"
+#include "os.h"
 #include <stdatomic.h>
 
 /*
@@ -16,6 +18,22 @@
 
 #define MIN_BLOCK_SIZE (DSIZE + HEADER_FOOTER_OVERHEAD)
 
+// make the list writable up to end bytes from its header.
+static inline bool implicitList_commit_to(ImplicitList *h, uint64_t end)
+{
+    return end <= atomic_load_explicit(&h->commit_end, memory_order_relaxed) ||
+           partition_allocator_commit_to(h, &h->commit_end, end);
+}
+
+// the end tags of the list sit in its last page, past the commit mark.
+static inline bool implicitList_commit_tail(ImplicitList *h, uintptr_t tags)
+{
+    if (tags + DSIZE - (uintptr_t)h <= atomic_load_explicit(&h->commit_end, memory_order_relaxed)) {
+        return true;
+    }
+    return commit_memory((void *)ALIGN_DOWN_2(tags, os_page_size), os_page_size);
+}
+
 static inline void implicitList_block_set_header(HeapBlock *hb, const uint32_t s, const uint32_t v, const uint32_t pa)
 {
     // Set the header with size, allocated bit, and previous allocated bit
@@ -228,16 +246,36 @@ void *implicitList_get_block(ImplicitList *h, uint32_t s, uint32_t align)
         // we delay this just so that we do not touch the pages till needed
         uint8_t *blocks = (uint8_t *)h + sizeof(ImplicitList);
         HeapBlock *hb = (HeapBlock *)(blocks + DSIZE * 2);
+        if (!implicitList_commit_tail(h, (uintptr_t)&hb->data + h->total_memory - DSIZE)) {
+            h->num_allocations--;
+            return NULL;
+        }
         implicitList_block_set_footer(hb, h->total_memory, 0);
         implicitList_block_set_header(implicitList_block_next(hb), 0, 1, 0);
 
     }
     s = implicitList_get_good_size(s);
+    // nothing past zero_offset has been written, so a fit carved from there
+    // ends within a block and the tags and links of the split.
+    const uint32_t first = (uint32_t)(sizeof(ImplicitList) + DSIZE * 2);
+    const uint64_t written = MAX(h->zero_offset, first);
+    if (!implicitList_commit_to(h, written + s + align + MIN_BLOCK_SIZE * 2 + sizeof(QNode))) {
+        h->num_allocations--;
+        return NULL;
+    }
     void *ptr = implicitList_find_fit(h, s, align);
     if(ptr != NULL)
     {
         h->used_memory += s;
         h->max_block -= s;
+        // a block split off the front of untouched memory only had the free
+        // list links written into it. Anything else carries old tags or data.
+        const uint32_t offset = (uint32_t)((uintptr_t)ptr - (uintptr_t)h);
+        const uint32_t bsize = (uint32_t)implicitList_get_block_size(ptr);
+        HeapBlock *next = implicitList_block_next((HeapBlock *)ptr);
+        h->last_zero = h->is_zero && offset >= h->zero_offset && align == sizeof(void*) &&
+                       (implicitList_block_get_header(next) & 0x1) == 0;
+        h->zero_offset = MAX(h->zero_offset, (offset + bsize));
     }
     else
     {
@@ -252,7 +290,12 @@ bool implicitList_resize_block(ImplicitList *h, void *bp, int32_t size)
     // and the next block is free.
     HeapBlock *hb = (HeapBlock *)bp;
     int header = implicitList_block_get_header(hb);
-    int32_t bsize = header & ~0x7;
+    const uint32_t bsize = header & ~0x7;
+    const uint32_t asize = implicitList_get_good_size(size);
+    if (asize <= bsize) {
+        // still fits within the old block.
+        return true;
+    }
 
     //
     HeapBlock *next_block = implicitList_block_next(hb);
@@ -263,18 +306,57 @@ bool implicitList_resize_block(ImplicitList *h, void *bp, int32_t size)
         return false;
     }
     //
-    const size_t next_size = next_header & ~0x7;
-    if ((bsize + next_size) >= (size_t)size) {
-        // merge the two blocks
-        const uint32_t prev_alloc = (header & 0x3) >> 1;
-        size += next_size;
-        implicitList_block_set_header(hb, size, 0, prev_alloc);
-        implicitList_block_set_footer(hb, size, 0);
-        list_remove(&h->free_nodes, (QNode *)next_block);
-        return true;
+    const uint32_t next_size = next_header & ~0x7;
+    const uint32_t csize = bsize + next_size;
+    if (csize < asize) {
+        return false;
     }
-    //
-    return false;
+    // the grown block and the tags and links of what is split off.
+    const uint32_t offset = (uint32_t)((uintptr_t)bp - (uintptr_t)h);
+    if (!implicitList_commit_to(h, (uint64_t)offset + asize + MIN_BLOCK_SIZE + sizeof(QNode))) {
+        return false;
+    }
+    h->zero_offset = MAX(h->zero_offset, (offset + asize));
+    // merge the two blocks
+    const uint32_t prev_alloc = (header & 0x3) >> 1;
+    list_remove(&h->free_nodes, (QNode *)next_block);
+    if ((csize - asize) >= MIN_BLOCK_SIZE) {
+        // split off what we don't need and hand it back to the free list.
+        implicitList_block_set_header(hb, asize, 1, prev_alloc);
+        HeapBlock *rest = implicitList_block_next(hb);
+        implicitList_block_set_header(rest, csize - asize, 0, 1);
+        implicitList_block_set_footer(rest, csize - asize, 0);
+        list_enqueue(&h->free_nodes, (QNode *)rest);
+        h->used_memory += asize - bsize;
+    } else {
+        implicitList_block_set_header(hb, csize, 1, prev_alloc);
+        // the block after us now has an allocated predecessor.
+        *(uint32_t *)((uint8_t *)&implicitList_block_next(hb)->data - WSIZE) |= 0x2;
+        h->used_memory += next_size;
+    }
+    return true;
+}
+
+bool implicitList_shrink_block(ImplicitList *h, void *bp, int32_t size)
+{
+    HeapBlock *hb = (HeapBlock *)bp;
+    int header = implicitList_block_get_header(hb);
+    const uint32_t bsize = header & ~0x7;
+    const uint32_t asize = implicitList_get_good_size(size);
+    if (asize >= bsize || (bsize - asize) < MIN_BLOCK_SIZE) {
+        // nothing worth splitting off.
+        return false;
+    }
+    const uint32_t prev_alloc = (header & 0x3) >> 1;
+    implicitList_block_set_header(hb, asize, 1, prev_alloc);
+    
+    // the tail becomes its own allocation that we immediately free,
+    // so it coalesces with the next block if that one is free.
+    HeapBlock *rest = implicitList_block_next(hb);
+    implicitList_block_set_header(rest, bsize - asize, 1, 1);
+    h->num_allocations++;
+    implicitList_free(h, rest, true);
+    return true;
 }
 
 void *implicitList_coalesce(ImplicitList *h, void *bp)
@@ -409,10 +491,13 @@ void implicitList_init(ImplicitList *h, int8_t pidx, const size_t psize)
     h->max_block = h->total_memory;
     h->min_block = sizeof(uint32_t);
     h->num_allocations = 0;
+    h->zero_offset = 0;
+    h->last_zero = 0;
     h->next = NULL;
     h->prev = NULL;
     h->deferred_free = NULL;
     h->thread_free = NULL;
+    atomic_store(&h->commit_end, partition_allocator_initial_commit(psize));
     implicitList_extend(h);
 }
 
@@ -45,6 +45,7 @@ static inline int32_t implicitList_get_good_size(uint32_t s)
 
 void *implicitList_get_block(ImplicitList *h, uint32_t s, uint32_t align);
 bool implicitList_resize_block(ImplicitList *h, void *bp, int32_t size);
+bool implicitList_shrink_block(ImplicitList *h, void *bp, int32_t size);
 static inline void implicitList_update_max(ImplicitList *h, uint32_t size)
 {
     if (size > h->max_block) {
@@ -8,4 +8,6 @@
 #include "partition_allocator.c"
 #include "allocator.c"
 #include "implicit_list.c"
-#include "arena.c"
\ No newline at end of file
+#include "arena.c"
+#include "memops.c"
+#include "maintenance.c"
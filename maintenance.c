@@ -0,0 +1,115 @@
+#include "maintenance.h"
+#include "partition_allocator.h"
+
+extern PartitionAllocator *partition_allocator;
+
+// how many epochs of releases the decay curve remembers.
+#define MAINTENANCE_DECAY_STEPS 64
+// fixed point bits of the decay curve.
+#define MAINTENANCE_DECAY_BFP 24
+
+_Atomic(bool) maintenance_running = false;
+_Atomic(uint64_t) maintenance_clock_ms = 0;
+static _Atomic(bool) maintenance_stopping = false;
+static thrd_t maintenance_thread;
+static uint32_t maintenance_tick_ms = 0;
+static uint32_t maintenance_ticks_per_epoch = 1;
+static uint32_t maintenance_decay_ms = 0;
+
+// bytes released in each of the last epochs, and how much of each the
+// curve lets stay unpurged.
+static uint64_t decay_backlog[MAINTENANCE_DECAY_STEPS];
+static uint64_t decay_curve[MAINTENANCE_DECAY_STEPS];
+static uint32_t decay_epoch = 0;
+static uint64_t decay_last_released = 0;
+
+static void maintenance_init_decay(void)
+{
+    // 1 - smoothstep, so fresh releases mostly stay and old ones go.
+    for (uint32_t i = 0; i < MAINTENANCE_DECAY_STEPS; i++) {
+        double x = (double)(i + 1) / MAINTENANCE_DECAY_STEPS;
+        double smooth = x * x * (3.0 - 2.0 * x);
+        decay_curve[i] = (uint64_t)((1.0 - smooth) * (double)(1ULL << MAINTENANCE_DECAY_BFP));
+        decay_backlog[i] = 0;
+    }
+    decay_epoch = 0;
+    decay_last_released = partition_allocator_released_bytes(partition_allocator);
+}
+
+static void maintenance_decay_epoch(void)
+{
+    uint64_t released = partition_allocator_released_bytes(partition_allocator);
+    decay_epoch = (decay_epoch + 1) % MAINTENANCE_DECAY_STEPS;
+    decay_backlog[decay_epoch] = released - decay_last_released;
+    decay_last_released = released;
+    
+    size_t pending = partition_allocator_pending_bytes(partition_allocator);
+    if (pending == 0) {
+        return;
+    }
+    uint64_t limit = 0;
+    if (maintenance_decay_ms != 0) {
+        // in 4k units, so the product stays inside 64 bits.
+        for (uint32_t age = 0; age < MAINTENANCE_DECAY_STEPS; age++) {
+            uint32_t idx = (decay_epoch + MAINTENANCE_DECAY_STEPS - age) % MAINTENANCE_DECAY_STEPS;
+            limit += (decay_backlog[idx] >> 12) * decay_curve[age] >> (MAINTENANCE_DECAY_BFP - 12);
+        }
+    }
+    if (pending > limit) {
+        partition_allocator_purge_pending(partition_allocator, pending - limit);
+    }
+}
+
+static void *maintenance_main(void *arg)
+{
+    UNUSED(arg);
+    struct timespec ts;
+    ts.tv_sec = maintenance_tick_ms / 1000;
+    ts.tv_nsec = (long)(maintenance_tick_ms % 1000) * 1000000L;
+    uint32_t ticks = 0;
+    while (!atomic_load(&maintenance_stopping)) {
+        atomic_store_explicit(&maintenance_clock_ms, current_time_ms(), memory_order_relaxed);
+        if (++ticks >= maintenance_ticks_per_epoch) {
+            ticks = 0;
+            maintenance_decay_epoch();
+        }
+        thrd_sleep(&ts);
+    }
+    return NULL;
+}
+
+bool maintenance_start(uint32_t tick_ms, uint32_t decay_ms)
+{
+    if (atomic_load(&maintenance_running) || partition_allocator == NULL) {
+        return false;
+    }
+    maintenance_tick_ms = tick_ms == 0 ? 1 : tick_ms;
+    maintenance_decay_ms = decay_ms;
+    // an epoch is a slice of the decay window, but never shorter than a tick.
+    uint32_t epoch_ms = decay_ms / MAINTENANCE_DECAY_STEPS;
+    maintenance_ticks_per_epoch = epoch_ms <= maintenance_tick_ms ? 1 : epoch_ms / maintenance_tick_ms;
+    maintenance_init_decay();
+    
+    atomic_store(&maintenance_stopping, false);
+    atomic_store(&maintenance_clock_ms, current_time_ms());
+    atomic_store(&maintenance_running, true);
+    partition_allocator_defer_purge(true);
+    if (thrd_create(&maintenance_thread, maintenance_main, NULL) != thrd_success) {
+        partition_allocator_defer_purge(false);
+        atomic_store(&maintenance_running, false);
+        return false;
+    }
+    return true;
+}
+
+void maintenance_stop(void)
+{
+    if (!atomic_load(&maintenance_running)) {
+        return;
+    }
+    atomic_store(&maintenance_stopping, true);
+    thrd_join(maintenance_thread, NULL);
+    // frees purge inline again from here on.
+    partition_allocator_defer_purge(false);
+    atomic_store(&maintenance_running, false);
+}
@@ -0,0 +1,28 @@
+#ifndef MAINTENANCE_H
+#define MAINTENANCE_H
+/*
+    * Maintenance thread
+    *    * Optional. While it runs it owns all purging, frees only move
+    *      regions to pending_release and the thread gives the pages back
+    *      along a decay curve over how recently they were released.
+    *    * It also keeps a coarse clock, so the allocation paths that age
+    *      arenas never have to read the time themselves.
+*/
+#include "callocator.inl"
+#include "os.h"
+
+extern _Atomic(bool) maintenance_running;
+extern _Atomic(uint64_t) maintenance_clock_ms;
+
+bool maintenance_start(uint32_t tick_ms, uint32_t decay_ms);
+void maintenance_stop(void);
+
+static inline uint64_t maintenance_now_ms(void)
+{
+    if (atomic_load_explicit(&maintenance_running, memory_order_relaxed)) {
+        return atomic_load_explicit(&maintenance_clock_ms, memory_order_relaxed);
+    }
+    return current_time_ms();
+}
+
+#endif // MAINTENANCE_H
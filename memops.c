@@ -0,0 +1,192 @@
+#include "memops.h"
+
+#if (defined(__x86_64__) || defined(_M_X64)) && (defined(__GNUC__) || defined(__clang__))
+#define MEMOPS_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#ifndef bit_ERMS
+#define bit_ERMS (1 << 9)
+#endif
+#endif
+
+static void *memops_libc_copy(void *dst, const void *src, size_t n) { return memcpy(dst, src, n); }
+static void *memops_libc_zero(void *dst, size_t n) { return memset(dst, 0, n); }
+
+memops_copy_fn memops_copy_medium = memops_libc_copy;
+memops_copy_fn memops_copy_large = memops_libc_copy;
+memops_zero_fn memops_zero_medium = memops_libc_zero;
+memops_zero_fn memops_zero_large = memops_libc_zero;
+static uint32_t memops_features_found = MEMOPS_LIBC;
+
+#if defined(MEMOPS_X86)
+
+static void *memops_erms_copy(void *dst, const void *src, size_t n)
+{
+    void *d = dst;
+    __asm__ __volatile__("rep movsb" : "+D"(d), "+S"(src), "+c"(n) : : "memory");
+    return dst;
+}
+
+static void *memops_erms_zero(void *dst, size_t n)
+{
+    void *d = dst;
+    __asm__ __volatile__("rep stosb" : "+D"(d), "+c"(n) : "a"(0) : "memory");
+    return dst;
+}
+
+// the streaming kernels align the destination, stream whole vectors and
+// leave the unaligned head and tail to memcpy/memset.
+__attribute__((target("avx2")))
+static void *memops_avx2_stream_copy(void *dst, const void *src, size_t n)
+{
+    uint8_t *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+    size_t head = ALIGN_UP_2(d, 32) - (uintptr_t)d;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+    for (; n >= 128; n -= 128, d += 128, s += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)s);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+        __m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+        _mm256_stream_si256((__m256i *)d, a);
+        _mm256_stream_si256((__m256i *)(d + 32), b);
+        _mm256_stream_si256((__m256i *)(d + 64), c);
+        _mm256_stream_si256((__m256i *)(d + 96), e);
+    }
+    _mm_sfence();
+    memcpy(d, s, n);
+    return dst;
+}
+
+__attribute__((target("avx2")))
+static void *memops_avx2_stream_zero(void *dst, size_t n)
+{
+    uint8_t *d = (uint8_t *)dst;
+    size_t head = ALIGN_UP_2(d, 32) - (uintptr_t)d;
+    memset(d, 0, head);
+    d += head;
+    n -= head;
+    const __m256i z = _mm256_setzero_si256();
+    for (; n >= 128; n -= 128, d += 128) {
+        _mm256_stream_si256((__m256i *)d, z);
+        _mm256_stream_si256((__m256i *)(d + 32), z);
+        _mm256_stream_si256((__m256i *)(d + 64), z);
+        _mm256_stream_si256((__m256i *)(d + 96), z);
+    }
+    _mm_sfence();
+    memset(d, 0, n);
+    return dst;
+}
+
+__attribute__((target("avx512f")))
+static void *memops_avx512_stream_copy(void *dst, const void *src, size_t n)
+{
+    uint8_t *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+    size_t head = ALIGN_UP_2(d, 64) - (uintptr_t)d;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+    for (; n >= 256; n -= 256, d += 256, s += 256) {
+        __m512i a = _mm512_loadu_si512((const void *)s);
+        __m512i b = _mm512_loadu_si512((const void *)(s + 64));
+        __m512i c = _mm512_loadu_si512((const void *)(s + 128));
+        __m512i e = _mm512_loadu_si512((const void *)(s + 192));
+        _mm512_stream_si512((void *)d, a);
+        _mm512_stream_si512((void *)(d + 64), b);
+        _mm512_stream_si512((void *)(d + 128), c);
+        _mm512_stream_si512((void *)(d + 192), e);
+    }
+    _mm_sfence();
+    memcpy(d, s, n);
+    return dst;
+}
+
+__attribute__((target("avx512f")))
+static void *memops_avx512_stream_zero(void *dst, size_t n)
+{
+    uint8_t *d = (uint8_t *)dst;
+    size_t head = ALIGN_UP_2(d, 64) - (uintptr_t)d;
+    memset(d, 0, head);
+    d += head;
+    n -= head;
+    const __m512i z = _mm512_setzero_si512();
+    for (; n >= 256; n -= 256, d += 256) {
+        _mm512_stream_si512((void *)d, z);
+        _mm512_stream_si512((void *)(d + 64), z);
+        _mm512_stream_si512((void *)(d + 128), z);
+        _mm512_stream_si512((void *)(d + 192), z);
+    }
+    _mm_sfence();
+    memset(d, 0, n);
+    return dst;
+}
+
+static uint32_t memops_detect(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t features = MEMOPS_LIBC;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return features;
+    }
+    // the os has to save the wider registers for us to use them.
+    bool osxsave = (ecx & bit_OSXSAVE) != 0;
+    uint64_t xcr0 = 0;
+    if (osxsave) {
+        uint32_t lo, hi;
+        __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        xcr0 = ((uint64_t)hi << 32) | lo;
+    }
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return features;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    if (ebx & bit_ERMS) {
+        features |= MEMOPS_ERMS;
+    }
+    // ymm state
+    if ((ebx & bit_AVX2) && (xcr0 & 0x6) == 0x6) {
+        features |= MEMOPS_AVX2;
+    }
+    // opmask, upper zmm and hi16 zmm state
+    if ((ebx & bit_AVX512F) && (xcr0 & 0xe6) == 0xe6) {
+        features |= MEMOPS_AVX512;
+    }
+    return features;
+}
+
+#else
+
+static uint32_t memops_detect(void) { return MEMOPS_LIBC; }
+
+#endif
+
+void memops_init(void)
+{
+    uint32_t features = memops_detect();
+    memops_features_found = features;
+#if defined(MEMOPS_X86)
+    if (features & MEMOPS_ERMS) {
+        memops_copy_medium = memops_erms_copy;
+        memops_zero_medium = memops_erms_zero;
+        memops_copy_large = memops_erms_copy;
+        memops_zero_large = memops_erms_zero;
+    }
+    if (features & MEMOPS_AVX512) {
+        memops_copy_large = memops_avx512_stream_copy;
+        memops_zero_large = memops_avx512_stream_zero;
+    } else if (features & MEMOPS_AVX2) {
+        memops_copy_large = memops_avx2_stream_copy;
+        memops_zero_large = memops_avx2_stream_zero;
+    }
+#endif
+}
+
+uint32_t memops_get_features(void)
+{
+    return memops_features_found;
+}
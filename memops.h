@@ -0,0 +1,61 @@
+#ifndef MEMOPS_H
+#define MEMOPS_H
+/*
+    * Copy and zero kernels
+    *    * Block migrations in realloc and zeroing in zalloc go through here.
+    *    * Small sizes use plain stores so the data stays hot in cache.
+    *    * Large sizes use rep movsb/stosb on ERMS parts, and non-temporal
+    *      AVX2/AVX-512 stores past the streaming threshold, so a multi
+    *      megabyte move does not flush the caller's working set.
+    *    * The kernels are picked once at init from CPUID.
+*/
+#include "callocator.inl"
+#include <string.h>
+
+// below this, libc with normal stores is as good as anything.
+#define MEMOPS_SMALL_SIZE (4ULL * SZ_KB)
+// above this the destination is not expected to fit in cache.
+#define MEMOPS_STREAM_SIZE (2ULL * SZ_MB)
+
+typedef void *(*memops_copy_fn)(void *dst, const void *src, size_t n);
+typedef void *(*memops_zero_fn)(void *dst, size_t n);
+
+typedef enum
+{
+    MEMOPS_LIBC = 0,
+    MEMOPS_ERMS = 1 << 0,
+    MEMOPS_AVX2 = 1 << 1,
+    MEMOPS_AVX512 = 1 << 2,
+} memops_features;
+
+extern memops_copy_fn memops_copy_medium;
+extern memops_copy_fn memops_copy_large;
+extern memops_zero_fn memops_zero_medium;
+extern memops_zero_fn memops_zero_large;
+
+void memops_init(void);
+uint32_t memops_get_features(void);
+
+static inline void *mem_copy(void *dst, const void *src, size_t n)
+{
+    if (n < MEMOPS_SMALL_SIZE) {
+        return memcpy(dst, src, n);
+    }
+    if (n < MEMOPS_STREAM_SIZE) {
+        return memops_copy_medium(dst, src, n);
+    }
+    return memops_copy_large(dst, src, n);
+}
+
+static inline void *mem_zero(void *dst, size_t n)
+{
+    if (n < MEMOPS_SMALL_SIZE) {
+        return memset(dst, 0, n);
+    }
+    if (n < MEMOPS_STREAM_SIZE) {
+        return memops_zero_medium(dst, n);
+    }
+    return memops_zero_large(dst, n);
+}
+
+#endif // MEMOPS_H
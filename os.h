@@ -22,6 +22,7 @@
 #else
 #include <errno.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <sys/resource.h>
 #endif
@@ -208,6 +209,23 @@ static inline void *alloc_memory(void *base, size_t size, bool commit)
 #endif
 }
 
+// Reserve address space without backing it. The flags match the ones
+// decommit_memory maps with, so decommitted ranges merge back into the
+// surrounding reservation instead of leaving a new mapping behind.
+static inline void *reserve_memory(void *base, size_t size)
+{
+#if defined(WINDOWS)
+    return VirtualAlloc(base, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+#if defined(MAP_FIXED_NOREPLACE)
+    flags |= MAP_FIXED_NOREPLACE;
+#endif
+    void *result = mmap(base, size, PROT_NONE, flags, -1, 0);
+    return result == MAP_FAILED ? NULL : result;
+#endif
+}
+
 static inline bool commit_memory(void *base, size_t size)
 {
 #if defined(WINDOWS)
@@ -217,15 +235,120 @@ static inline bool commit_memory(void *base, size_t size)
 #endif
 }
 
+#define HUGE_PAGE_SIZE (2ULL * SZ_MB)
+
+// Ask for transparent huge pages on a range.
+static inline bool advise_hugepages(void *base, size_t size)
+{
+#if !defined(WINDOWS) && defined(MADV_HUGEPAGE)
+    return (madvise(base, size, MADV_HUGEPAGE) == 0);
+#else
+    UNUSED(base);
+    UNUSED(size);
+    return false;
+#endif
+}
+
+#if defined(__linux__)
+#ifndef MADV_COLD
+#define MADV_COLD 20
+#endif
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+#endif
+
+// Mark a range of live data as not needed soon. Cold pages are the first
+// to go when memory runs short, pageout reclaims them right away. The
+// contents stay either way.
+static inline bool advise_cold(void *base, size_t size, bool pageout)
+{
+#if defined(__linux__)
+    return (madvise(base, size, pageout ? MADV_PAGEOUT : MADV_COLD) == 0);
+#else
+    UNUSED(base);
+    UNUSED(size);
+    UNUSED(pageout);
+    return false;
+#endif
+}
+
+// Back a reserved range with pages from the hugetlb pool. When the pool
+// can't cover it, the range is put back as an inaccessible reservation.
+static inline bool commit_hugetlb(void *base, size_t size)
+{
+#if !defined(WINDOWS) && !defined(__APPLE__) && defined(MAP_HUGETLB)
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+    if (mmap(base, size, (PROT_READ | PROT_WRITE), flags | MAP_HUGETLB, -1, 0) == base) {
+        return true;
+    }
+    mmap(base, size, PROT_NONE, flags | MAP_NORESERVE, -1, 0);
+    return false;
+#else
+    UNUSED(base);
+    UNUSED(size);
+    return false;
+#endif
+}
+
 static inline bool decommit_memory(void *base, size_t size)
 {
 #if defined(WINDOWS)
     return VirtualFree(base, size, MEM_DECOMMIT);
-#else
+#elif defined(__APPLE__)
+    // madvise does not drop the pages here, replace them instead.
     return (mmap(base, size, PROT_NONE, (MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE), -1, 0) == base);
+#else
+    // dropping the pages and the rights in place keeps the mapping whole,
+    // mprotect merges the range back into the reservation around it.
+    if (madvise(base, size, MADV_DONTNEED) != 0) {
+        return false;
+    }
+    return (mprotect(base, size, PROT_NONE) == 0);
 #endif
 }
 
+// Give the pages of a range back while leaving it mapped.
+static inline bool purge_memory(void *base, size_t size, purge_mode mode)
+{
+#if defined(WINDOWS) || defined(__APPLE__)
+    UNUSED(mode);
+    return decommit_memory(base, size);
+#else
+    switch (mode) {
+    case PURGE_FREE:
+#if defined(MADV_FREE)
+        if (madvise(base, size, MADV_FREE) == 0) {
+            return true;
+        }
+#endif
+        // not supported by this kernel.
+        // fall through
+    case PURGE_DONTNEED:
+        return (madvise(base, size, MADV_DONTNEED) == 0);
+    default:
+        return decommit_memory(base, size);
+    }
+#endif
+}
+
+// Purge a batch of ranges with one call. Returns false when the kernel
+// can't do it, the caller then purges the ranges one by one.
+#if defined(__linux__) && defined(SYS_process_madvise) && defined(SYS_pidfd_open)
+#include <sys/uio.h>
+static inline bool purge_memory_batch(int pidfd, const struct iovec *ranges, size_t count, purge_mode mode)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += ranges[i].iov_len;
+    }
+    int advice = mode == PURGE_FREE ? MADV_FREE : MADV_DONTNEED;
+    long done = syscall(SYS_process_madvise, pidfd, ranges, count, advice, 0);
+    return done == (long)total;
+}
+#define PURGE_BATCH_SUPPORTED 1
+#endif
+
 static inline bool free_memory(void *ptr, size_t size)
 {
 #if defined(WINDOWS)
@@ -379,6 +502,41 @@ static inline bool remap_memory(void *old_addr, void *new_addr, size_t size) {
 #endif
 }
 
+// Grow a mapping in place. Never moves the memory.
+static inline bool extend_memory(void *base, size_t size, size_t new_size)
+{
+#if defined(_WIN32)
+    UNUSED(base);
+    UNUSED(size);
+    UNUSED(new_size);
+    return false;
+#elif defined(__linux__)
+    return mremap(base, size, new_size, 0) == base;
+#else
+    // try to claim the pages right after the mapping.
+    void *tail = (uint8_t *)base + size;
+    void *result = alloc_memory(tail, new_size - size, true);
+    if (result == tail) {
+        return true;
+    }
+    if (result != MAP_FAILED) {
+        free_memory(result, new_size - size);
+    }
+    return false;
+#endif
+}
+
+// Release the tail of a mapping. Never moves the memory.
+static inline bool shrink_memory(void *base, size_t size, size_t new_size)
+{
+    void *tail = (uint8_t *)base + new_size;
+#if defined(_WIN32)
+    return VirtualFree(tail, size - new_size, MEM_DECOMMIT);
+#else
+    return free_memory(tail, size - new_size);
+#endif
+}
+
 static inline size_t get_stack_limit(void)
 {
     struct rlimit limit;
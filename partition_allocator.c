@@ -3,11 +3,140 @@
 #include "os.h"
 #include "pool.h"
 #include "arena.h"
+#include <stdlib.h>
 
 cache_align PartitionAllocator *partition_allocator = NULL;
+cache_align PartitionLayout partition_layout = {
+    DEFAULT_BASE_ADDRESS,
+    0,
+    0,
+    DEFAULT_PARTITION_SIZE_EXP,
+};
+// set once the first block has been reserved, the layout is fixed from then on.
+static _Atomic(bool) partition_layout_locked = false;
+// how many spans past the preferred base we look before trying smaller partitions.
+#define PARTITION_PLACEMENT_TRIES 8
+// keep clear of the top of a 47 bit user address space.
+#define PARTITION_ADDRESS_LIMIT (1ULL << 47)
+#if defined(__linux__)
+static purge_mode partition_purge_mode = PURGE_DONTNEED;
+#else
+static purge_mode partition_purge_mode = PURGE_DECOMMIT;
+#endif
+// once a purge has been lazy, purged regions can't be assumed zero.
+static bool partition_purge_lazy = false;
+static bool partition_purge_batched = false;
+static int partition_pidfd = -1;
+// when set, releases only go to pending_release and a maintenance thread
+// does the purging.
+static _Atomic(bool) partition_purge_deferred = false;
+static hugepage_mode partition_hugepage_mode = HUGEPAGE_NONE;
+static uint64_t partition_hugepage_threshold = BASE_REGION_SIZE;
+static placement_policy partition_placement = PLACEMENT_FIRST_FIT;
+// when set, arenas and implicit lists get their regions writable this much
+// at a time instead of whole.
+static uint64_t partition_commit_step = 0;
 #define PARTITION_ALLOCATOR_STATIC_SIZE (1024 * 1024) // 1MB
 static uint8_t partition_allocator_static_buffer[PARTITION_ALLOCATOR_STATIC_SIZE] __attribute__((aligned(64)));
 
+static void partition_layout_apply(uintptr_t base, uint64_t size_exp)
+{
+    size_t span = (size_t)PARTITION_COUNT << size_exp;
+    partition_layout.base = base;
+    partition_layout.size_exp = size_exp;
+    // the os allocations sit a terabyte past the partitions.
+    partition_layout.os_base = ALIGN_UP_2(base + span, 1ULL << 40) + (1ULL << 40);
+    partition_layout.os_end = partition_layout.os_base + (2ULL << 40);
+}
+
+// Nothing can be mapped in [base, base+size) if we can reserve all of it.
+static bool partition_probe_range(uintptr_t base, size_t size)
+{
+    void* result = reserve_memory((void*)base, size);
+    if (result == NULL) {
+        return false;
+    }
+    free_memory(result, size);
+    return result == (void*)base;
+}
+
+// Find room for all the partitions, starting at the preferred base. When
+// that range is taken we move a span up at a time, and when the partitions
+// don't fit at all (address space limits) we make them smaller.
+static bool partition_layout_place(uintptr_t base, uint64_t size_exp)
+{
+    for (uint64_t exp = size_exp; exp >= PARTITION_MIN_SIZE_EXP; exp--) {
+        size_t span = (size_t)PARTITION_COUNT << exp;
+        uintptr_t candidate = ALIGN_UP_2(base, 1ULL << exp);
+        for (int i = 0; i < PARTITION_PLACEMENT_TRIES; i++, candidate += span) {
+            if (candidate + span > PARTITION_ADDRESS_LIMIT) {
+                break;
+            }
+            if (partition_probe_range(candidate, span)) {
+                partition_layout_apply(candidate, exp);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Sizes take an optional k, m, g or t suffix.
+static bool partition_layout_env(const char* name, uint64_t* value)
+{
+    const char* str = getenv(name);
+    if (str == NULL || *str == '\0') {
+        return false;
+    }
+    char* end = NULL;
+    uint64_t result = strtoull(str, &end, 0);
+    if (end == str) {
+        return false;
+    }
+    switch (*end) {
+        case 't': case 'T': result <<= 10; // fall through
+        case 'g': case 'G': result <<= 10; // fall through
+        case 'm': case 'M': result <<= 10; // fall through
+        case 'k': case 'K': result <<= 10; break;
+        default: break;
+    }
+    *value = result;
+    return true;
+}
+
+static uint64_t partition_size_to_exp(uint64_t size)
+{
+    if (size == 0) {
+        return DEFAULT_PARTITION_SIZE_EXP;
+    }
+    // round up to a power of two.
+    uint64_t exp = 63 - __builtin_clzll(size);
+    exp += !POWER_OF_TWO(size);
+    exp = MAX(exp, PARTITION_MIN_SIZE_EXP);
+    return MIN(exp, PARTITION_MAX_SIZE_EXP);
+}
+
+static void partition_layout_init(void)
+{
+    uint64_t base = DEFAULT_BASE_ADDRESS;
+    uint64_t size = 1ULL << DEFAULT_PARTITION_SIZE_EXP;
+    partition_layout_env("CALLOCATOR_BASE", &base);
+    partition_layout_env("CALLOCATOR_PARTITION_SIZE", &size);
+    uint64_t size_exp = partition_size_to_exp(size);
+    if (!partition_layout_place(base, size_exp)) {
+        // nothing fits, the blocks that can't be reserved are skipped later.
+        partition_layout_apply(ALIGN_UP_2(base, 1ULL << size_exp), size_exp);
+    }
+}
+
+static void partition_allocator_apply_layout(PartitionAllocator* allocator)
+{
+    allocator->totalMemory = PARTITION_COUNT * PARTITION_SIZE;
+    for (int i = 0; i < PARTITION_COUNT; i++) {
+        allocator->partitions[i].num_blocks = PARTITION_SIZE / allocator->partitions[i].blockSize;
+    }
+}
+
 // Returns a pointer to the initialized allocator.
 PartitionAllocator* partition_allocator__create(void) {
     if(partition_allocator != NULL)
@@ -27,51 +156,111 @@ PartitionAllocator* partition_allocator__create(void) {
         32ULL * 1024 * 1024 * 1024,     // 32GB
         64ULL * 1024 * 1024 * 1024,     // 64GB
     };
-    size_t base_count = PARTITION_SIZE/blockSizes[0];
-    // Add per-partition metadata (aligned to 64 bytes).
-    const size_t partition_meta_sizes[PARTITION_COUNT] = { // 9 * 1TB blocks
-        base_count * sizeof(PartitionMasks),  // Partition 0 (256MB blocks)
-        base_count/2 * sizeof(PartitionMasks),  // Partition 1 (512MB blocks)
-        base_count/4 * sizeof(PartitionMasks),  // Partition 2 (1024MB blocks)
-        base_count/8 * sizeof(PartitionMasks),  // Partition 3 (2048MB blocks)
-        base_count/16 * sizeof(PartitionMasks),  // Partition 4 (4096MB blocks)
-        base_count/32 * sizeof(PartitionMasks),  // Partition 5 (8192MB blocks)
-        base_count/64 * sizeof(PartitionMasks),  // Partition 6 (16384MB blocks)
-        base_count/128 * sizeof(PartitionMasks),  // Partition 7 (32768MB blocks)
-        base_count/256 * sizeof(PartitionMasks),  // Partition 8 (65536MB blocks)
-    };
-
+    // the metadata is laid out for the largest partitions, so the layout
+    // can still change before the first block is reserved.
     for (int i = 0; i < PARTITION_COUNT; i++) {
+        size_t num_blocks = (1ULL << PARTITION_MAX_SIZE_EXP) / blockSizes[i];
+        total_size = ALIGN_CACHE(total_size);
+        total_size += num_blocks * sizeof(PartitionMasks);
+        total_size = ALIGN_CACHE(total_size);
+        total_size += num_blocks * sizeof(PartitionExtents);
         total_size = ALIGN_CACHE(total_size);
-        total_size += partition_meta_sizes[i];
+        total_size += ALIGN_UP_2(num_blocks, 64)/8;
+        total_size = ALIGN_CACHE(total_size);
+        total_size += ALIGN_UP_2(num_blocks, 64)/8;
+    }
+    if (total_size > PARTITION_ALLOCATOR_STATIC_SIZE) {
+        return NULL;
     }
 
-    // Allocate the entire block.
+    // The buffer lives in bss, so it is already zero and its pages are
+    // only backed once something writes to them.
     void* memory = partition_allocator_static_buffer;
-    memset(memory, 0, total_size);
 
     // Set up the allocator.
     PartitionAllocator* allocator = (PartitionAllocator*)memory;
-    allocator->totalMemory = PARTITION_COUNT * PARTITION_SIZE;
 
     //  Initialize partitions.
     uintptr_t current = (uintptr_t)memory + sizeof(PartitionAllocator);
     for (int i = 0; i < PARTITION_COUNT; i++) {
+        size_t num_blocks = (1ULL << PARTITION_MAX_SIZE_EXP) / blockSizes[i];
         current = ALIGN_CACHE(current);
         allocator->partitions[i].blocks = (PartitionMasks*)current;
-        allocator->partitions[i].num_blocks = PARTITION_SIZE / blockSizes[i];
         allocator->partitions[i].blockSize = blockSizes[i];
-        current += partition_meta_sizes[i];
+        current += num_blocks * sizeof(PartitionMasks);
+        
+        current = ALIGN_CACHE(current);
+        allocator->partitions[i].extents = (PartitionExtents*)current;
+        current += num_blocks * sizeof(PartitionExtents);
+        
+        // every block starts out with free regions, nothing to write.
+        current = ALIGN_CACHE(current);
+        allocator->partitions[i].full_blocks = (_Atomic(uint64_t)*)current;
+        current += ALIGN_UP_2(num_blocks, 64)/8;
+
+        current = ALIGN_CACHE(current);
+        allocator->partitions[i].abandoned_blocks = (_Atomic(uint64_t)*)current;
+        current += ALIGN_UP_2(num_blocks, 64)/8;
     }
+    partition_layout_init();
+    partition_allocator_apply_layout(allocator);
 
     return allocator;
 }
 
+bool partition_allocator_set_layout(PartitionAllocator* palloc, uintptr_t base, size_t partition_size)
+{
+    if (atomic_load_explicit(&partition_layout_locked, memory_order_acquire)) {
+        return false;
+    }
+    if (!partition_layout_place(base, partition_size_to_exp(partition_size))) {
+        return false;
+    }
+    partition_allocator_apply_layout(palloc);
+    return true;
+}
+
+static inline PartitionExtents* partition_extents(Partition* partition, PartitionMasks* block)
+{
+    return &partition->extents[block - partition->blocks];
+}
+
+static inline void partition_mark_block_abandoned(Partition* partition, size_t block_idx)
+{
+    size_t word = block_idx >> 6;
+    atomic_fetch_or_explicit(&partition->abandoned_blocks[word],
+                             1ULL << (block_idx & 63),
+                             memory_order_release);
+    atomic_fetch_or_explicit(&partition->abandoned_words,
+                             1ULL << word,
+                             memory_order_release);
+}
+
+static inline void partition_mark_block_adopted(Partition* partition, size_t block_idx)
+{
+    size_t word = block_idx >> 6;
+    uint64_t bit = 1ULL << (block_idx & 63);
+    atomic_fetch_and_explicit(&partition->abandoned_blocks[word], ~bit, memory_order_acq_rel);
+    // a thread may have died in this block before we cleared the bit.
+    if (atomic_load(&partition->blocks[block_idx].abandoned) != 0) {
+        partition_mark_block_abandoned(partition, block_idx);
+        return;
+    }
+    if (atomic_load(&partition->abandoned_blocks[word]) == 0) {
+        atomic_fetch_and_explicit(&partition->abandoned_words, ~(1ULL << word), memory_order_acq_rel);
+        if (atomic_load(&partition->abandoned_blocks[word]) != 0) {
+            atomic_fetch_or_explicit(&partition->abandoned_words, 1ULL << word, memory_order_release);
+        }
+    }
+}
+
 /*
     Abandon blocks in a partition.  
 
-    This will mark the blocks as abandoned
+    This will mark the region as abandoned
     and will allow the allocator to reclaim them later.
+    Only the first region of the range is marked, that is where the
+    header sits and what a claim clears.
 */
 bool partition_allocator_abandon_blocks(PartitionAllocator* palloc,
                                      void* addr) {
@@ -84,18 +273,11 @@ bool partition_allocator_abandon_blocks(PartitionAllocator* palloc,
     // Return the corresponding
     Partition* partition = &palloc->partitions[loc.partition];
     PartitionMasks* block = &partition->blocks[loc.block];
-    uint32_t range = get_range(loc.region, block->ranges);
-    
-    // Update allocation masks
-    uint64_t area_clear_mask = (range == 64)
-        ? ~0ULL
-        : ((1ULL << range) - 1) << loc.region;
-    
     
     atomic_fetch_or_explicit(&block->abandoned,
-                              area_clear_mask,
+                              1ULL << loc.region,
                               memory_order_release);
-    
+    partition_mark_block_abandoned(partition, loc.block);
     
     return true;
 }
@@ -110,7 +292,8 @@ bool partition_allocator_reset_block(PartitionAllocator* palloc,
     // Return the corresponding
     Partition* partition = &palloc->partitions[loc.partition];
     PartitionMasks* block = &partition->blocks[loc.block];
-    uint32_t range = get_range(loc.region, block->ranges);
+    PartitionExtents* extents = partition_extents(partition, block);
+    uint32_t range = get_range(loc.region, extents->ranges);
     
     // Update allocation masks
     uint64_t area_clear_mask = (range == 64)
@@ -126,6 +309,360 @@ bool partition_allocator_reset_block(PartitionAllocator* palloc,
     return reset_memory((void*)block_addr, region_size*range);
 }
 
+static inline uint64_t partition_count_mask(size_t count)
+{
+    return count >= 64 ? ~0ULL : (1ULL << count) - 1;
+}
+
+// summary words that still have a block with room.
+static inline uint64_t partition_free_words(Partition* partition)
+{
+    size_t num_words = ALIGN_UP_2(partition->num_blocks, 64)/64;
+    return ~atomic_load(&partition->full_words) & partition_count_mask(num_words);
+}
+
+// blocks of a summary word that still have room.
+static inline uint64_t partition_free_blocks(Partition* partition, size_t word)
+{
+    return ~atomic_load(&partition->full_blocks[word]) & partition_count_mask(partition->num_blocks - word*64);
+}
+
+static inline void partition_mark_block_free(Partition* partition, size_t block_idx)
+{
+    size_t word = block_idx >> 6;
+    atomic_fetch_and_explicit(&partition->full_blocks[word],
+                              ~(1ULL << (block_idx & 63)),
+                              memory_order_release);
+    atomic_fetch_and_explicit(&partition->full_words,
+                              ~(1ULL << word),
+                              memory_order_release);
+}
+
+static inline bool partition_block_is_full(PartitionMasks* block)
+{
+    return atomic_load(&block->committed) == ~0ULL && atomic_load(&block->pending_release) == 0;
+}
+
+static inline void partition_mark_block_full(Partition* partition, size_t block_idx)
+{
+    size_t word = block_idx >> 6;
+    uint64_t bit = 1ULL << (block_idx & 63);
+    atomic_fetch_or_explicit(&partition->full_blocks[word], bit, memory_order_acq_rel);
+    // a release may have slipped in before we set the bit.
+    if (!partition_block_is_full(&partition->blocks[block_idx])) {
+        partition_mark_block_free(partition, block_idx);
+        return;
+    }
+    if (partition_free_blocks(partition, word) == 0) {
+        atomic_fetch_or_explicit(&partition->full_words, 1ULL << word, memory_order_acq_rel);
+        if (partition_free_blocks(partition, word) != 0) {
+            atomic_fetch_and_explicit(&partition->full_words, ~(1ULL << word), memory_order_release);
+        }
+    }
+}
+
+// a reserved block is one mapping, and every switch between writable
+// and inaccessible regions splits off another one.
+static inline int64_t partition_mask_vmas(uint64_t writable)
+{
+    return 1 + __builtin_popcountll((writable ^ (writable >> 1)) & (~0ULL >> 1));
+}
+
+static inline void partition_track_writable(PartitionAllocator* palloc, uint64_t prev, uint64_t next)
+{
+    atomic_fetch_add_explicit(&palloc->vma_count,
+                              partition_mask_vmas(next) - partition_mask_vmas(prev),
+                              memory_order_relaxed);
+}
+
+static inline uint64_t partition_run_length(uint64_t runs, uint32_t start)
+{
+    uint64_t rest = ~(runs >> start);
+    return rest == 0 ? 64 - start : (uint32_t)__builtin_ctzll(rest);
+}
+
+static inline uint64_t partition_run_mask(uint32_t start, uint64_t len)
+{
+    return (len == 64 ? ~0ULL : ((1ULL << len) - 1)) << start;
+}
+
+static inline bool partition_uses_hugepages(uint64_t region_size)
+{
+    return partition_hugepage_mode != HUGEPAGE_NONE && region_size >= partition_hugepage_threshold;
+}
+
+// Make a run writable, backed by huge pages when the policy asks for them.
+static inline bool partition_commit_run(void* addr, size_t size, uint64_t region_size)
+{
+    if (!partition_uses_hugepages(region_size)) {
+        return commit_memory(addr, size);
+    }
+    if (partition_hugepage_mode == HUGEPAGE_EXPLICIT) {
+        if (commit_hugetlb(addr, size)) {
+            return true;
+        }
+        // no hugetlb pages to be had, stop asking for them.
+        partition_hugepage_mode = HUGEPAGE_ADVISE;
+    }
+    if (!commit_memory(addr, size)) {
+        return false;
+    }
+    advise_hugepages(addr, size);
+    return true;
+}
+
+// Make the regions in area writable, one call per run that isn't yet.
+// A partial commit only makes the first step writable, the owner commits
+// the rest as it goes.
+static inline bool partition_commit_area(PartitionAllocator* palloc,
+                                         PartitionMasks* block,
+                                         uintptr_t base_addr,
+                                         uint64_t region_size,
+                                         uint64_t area,
+                                         bool partial)
+{
+    uint64_t writable = atomic_load(&block->writable);
+    if (partial) {
+        uint32_t first = __builtin_ctzll(area);
+        // any writable region has at least its first step committed.
+        if ((writable & (1ULL << first)) == 0 &&
+            !commit_memory((void*)(base_addr + first*region_size), partition_commit_step)) {
+            return false;
+        }
+        uint64_t added = area & ~writable;
+        atomic_fetch_or(&block->partial, added);
+        uint64_t prev = atomic_fetch_or(&block->writable, added);
+        partition_track_writable(palloc, prev, prev | added);
+        return true;
+    }
+    uint64_t runs = area & (~writable | atomic_load(&block->partial));
+    if (runs == 0) {
+        return true;
+    }
+    uint64_t committed = 0;
+    while (runs != 0) {
+        uint32_t start = __builtin_ctzll(runs);
+        uint64_t len = partition_run_length(runs, start);
+        if (!partition_commit_run((void*)(base_addr + start*region_size), region_size*len, region_size)) {
+            break;
+        }
+        committed |= partition_run_mask(start, len);
+        runs &= ~partition_run_mask(start, len);
+    }
+    atomic_fetch_and(&block->partial, ~committed);
+    uint64_t prev = atomic_fetch_or(&block->writable, committed);
+    partition_track_writable(palloc, prev, prev | committed);
+    return runs == 0;
+}
+
+// Address spans waiting for one purge. Runs that touch are merged, also
+// when they continue into the next block.
+#define PURGE_MAX_SPANS 32
+typedef struct
+{
+    uintptr_t addr[PURGE_MAX_SPANS];
+    size_t len[PURGE_MAX_SPANS];
+    uint32_t count;
+} PurgeSpans;
+
+static inline void partition_purge_spans(PurgeSpans* spans, purge_mode mode)
+{
+    bool purged = false;
+#if defined(PURGE_BATCH_SUPPORTED)
+    if (mode != PURGE_DECOMMIT && partition_purge_batched && partition_pidfd >= 0 && spans->count > 1) {
+        struct iovec batch[PURGE_MAX_SPANS];
+        for (uint32_t i = 0; i < spans->count; i++) {
+            batch[i].iov_base = (void*)spans->addr[i];
+            batch[i].iov_len = spans->len[i];
+        }
+        purged = purge_memory_batch(partition_pidfd, batch, spans->count, mode);
+        if (!purged) {
+            // the kernel doesn't take this advice in a batch.
+            partition_purge_batched = false;
+        }
+    }
+#endif
+    for (uint32_t i = 0; !purged && i < spans->count; i++) {
+        purge_memory((void*)spans->addr[i], spans->len[i], mode);
+    }
+    spans->count = 0;
+}
+
+static inline void partition_add_spans(PurgeSpans* spans,
+                                       uintptr_t base_addr,
+                                       uint64_t region_size,
+                                       uint64_t area,
+                                       purge_mode mode)
+{
+    while (area != 0) {
+        uint32_t start = __builtin_ctzll(area);
+        uint64_t len = partition_run_length(area, start);
+        uintptr_t addr = base_addr + start*region_size;
+        uint32_t last = spans->count - 1;
+        if (spans->count > 0 && spans->addr[last] + spans->len[last] == addr) {
+            spans->len[last] += region_size*len;
+        } else {
+            if (spans->count == PURGE_MAX_SPANS) {
+                partition_purge_spans(spans, mode);
+            }
+            spans->addr[spans->count] = addr;
+            spans->len[spans->count] = region_size*len;
+            spans->count++;
+        }
+        area &= ~partition_run_mask(start, len);
+    }
+}
+
+// After the spans of a block have been purged, give its regions back.
+// One atomic per mask.
+static inline void partition_finish_purge(PartitionAllocator* palloc,
+                                          PartitionMasks* block,
+                                          uint64_t area,
+                                          purge_mode mode)
+{
+    if (mode == PURGE_DECOMMIT) {
+        atomic_fetch_and(&block->partial, ~area);
+        uint64_t prev = atomic_fetch_and(&block->writable, ~area);
+        partition_track_writable(palloc, prev, prev & ~area);
+    }
+    atomic_fetch_and(&block->committed, ~area);
+}
+
+// Drop the access rights of every region in area.
+static inline void partition_protect_area(PartitionAllocator* palloc,
+                                          PartitionMasks* block,
+                                          uintptr_t base_addr,
+                                          uint64_t region_size,
+                                          uint64_t area)
+{
+    PurgeSpans spans;
+    spans.count = 0;
+    uint64_t dropped = area & atomic_load(&block->writable);
+    partition_add_spans(&spans, base_addr, region_size, dropped, PURGE_DECOMMIT);
+    partition_purge_spans(&spans, PURGE_DECOMMIT);
+    atomic_fetch_and(&block->partial, ~dropped);
+    uint64_t prev = atomic_fetch_and(&block->writable, ~dropped);
+    partition_track_writable(palloc, prev, prev & ~dropped);
+}
+
+// Purge every region in area, one call per run of adjacent regions, and
+// hand the regions back to the committed mask.
+static inline void partition_decommit_area(PartitionAllocator* palloc,
+                                           PartitionMasks* block,
+                                           uintptr_t base_addr,
+                                           uint64_t region_size,
+                                           uint64_t area)
+{
+    purge_mode mode = partition_purge_mode;
+    PurgeSpans spans;
+    spans.count = 0;
+    partition_add_spans(&spans, base_addr, region_size, area, mode);
+    partition_purge_spans(&spans, mode);
+    partition_finish_purge(palloc, block, area, mode);
+}
+
+// The range marks of every range in area.
+static inline uint64_t partition_range_marks(uint64_t area, uint64_t ranges)
+{
+    uint64_t marks = 0;
+    int32_t region_idx = get_next_mask_idx(area, 0);
+    while (region_idx != -1) {
+        uint32_t size_in_blocks = get_range((uint32_t)region_idx, ranges);
+        if (size_in_blocks > 1) {
+            marks |= (1ULL << region_idx) | (1ULL << (region_idx + size_in_blocks - 1));
+        }
+        region_idx = get_next_mask_idx(area, region_idx + size_in_blocks);
+    }
+    return marks;
+}
+
+static inline void partition_untrack_pending(PartitionAllocator* palloc, Partition* partition, uint64_t area)
+{
+    atomic_fetch_sub_explicit(&palloc->pending_bytes,
+                              (int64_t)(__builtin_popcountll(area) * (partition->blockSize/64)),
+                              memory_order_relaxed);
+}
+
+// Take everything pending release in a block, clearing the range marks.
+static inline uint64_t partition_take_pending(PartitionAllocator* palloc,
+                                              Partition* partition,
+                                              PartitionMasks* block)
+{
+    PartitionExtents* extents = partition_extents(partition, block);
+    uint64_t free_mask = atomic_exchange(&block->pending_release, 0ULL);
+    if (free_mask == 0) {
+        return 0;
+    }
+    partition_untrack_pending(palloc, partition, free_mask);
+    uint64_t range_clear_mask = partition_range_marks(free_mask, atomic_load(&extents->ranges));
+    if (range_clear_mask != 0) {
+        atomic_fetch_and_explicit(&extents->ranges,
+                                  ~range_clear_mask,
+                                  memory_order_relaxed);
+    }
+    return free_mask;
+}
+
+// Drain the pending releases of a block together with the neighbours its
+// released regions run into, so spans that cross a block boundary are
+// purged with one call.
+#define PURGE_MAX_BLOCKS 8
+static size_t partition_drain_pending(PartitionAllocator* palloc, uint32_t partition_idx, size_t block_idx)
+{
+    Partition* partition = &palloc->partitions[partition_idx];
+    uint64_t region_size = partition->blockSize/64;
+    uintptr_t partition_base = (uintptr_t)(BASE_ADDRESS + partition_idx*PARTITION_SIZE);
+    purge_mode mode = partition_purge_mode;
+    
+    // walk back while the previous block's release ends where ours starts.
+    size_t first = block_idx;
+    while (first > 0 &&
+           (atomic_load(&partition->blocks[first].pending_release) & 1ULL) != 0 &&
+           (atomic_load(&partition->blocks[first - 1].pending_release) >> 63) != 0) {
+        first--;
+    }
+    
+    PurgeSpans spans;
+    spans.count = 0;
+    size_t taken[PURGE_MAX_BLOCKS];
+    uint64_t areas[PURGE_MAX_BLOCKS];
+    uint32_t num_taken = 0;
+    uint64_t last_area = 0;
+    size_t drained = 0;
+    for (size_t i = first; i < partition->num_blocks; i++) {
+        if (i > block_idx &&
+            ((last_area >> 63) == 0 ||
+             (atomic_load(&partition->blocks[i].pending_release) & 1ULL) == 0)) {
+            break;
+        }
+        uint64_t area = partition_take_pending(palloc, partition, &partition->blocks[i]);
+        if (area == 0) {
+            if (i >= block_idx) {
+                break;
+            }
+            continue;
+        }
+        if (num_taken == PURGE_MAX_BLOCKS) {
+            partition_purge_spans(&spans, mode);
+            for (uint32_t t = 0; t < num_taken; t++) {
+                partition_finish_purge(palloc, &partition->blocks[taken[t]], areas[t], mode);
+            }
+            num_taken = 0;
+        }
+        partition_add_spans(&spans, partition_base + i*partition->blockSize, region_size, area, mode);
+        taken[num_taken] = i;
+        areas[num_taken] = area;
+        num_taken++;
+        last_area = area;
+        drained += __builtin_popcountll(area) * region_size;
+    }
+    partition_purge_spans(&spans, mode);
+    for (uint32_t t = 0; t < num_taken; t++) {
+        partition_finish_purge(palloc, &partition->blocks[taken[t]], areas[t], mode);
+    }
+    return drained;
+}
+
 bool partition_allocator_free_blocks(PartitionAllocator* palloc,
                                      void* addr,
                                      bool should_decommit) {
@@ -138,7 +675,8 @@ bool partition_allocator_free_blocks(PartitionAllocator* palloc,
     // Return the corresponding
     Partition* partition = &palloc->partitions[loc.partition];
     PartitionMasks* block = &partition->blocks[loc.block];
-    uint32_t range = get_range(loc.region, block->ranges);
+    PartitionExtents* extents = partition_extents(partition, block);
+    uint32_t range = get_range(loc.region, extents->ranges);
     
     // Update allocation masks
     uint64_t area_clear_mask = (range == 64)
@@ -146,44 +684,17 @@ bool partition_allocator_free_blocks(PartitionAllocator* palloc,
         : ((1ULL << range) - 1) << loc.region;
     
     
-    atomic_fetch_or_explicit(&block->pending_release,
-                              area_clear_mask,
-                              memory_order_release);
-    
+    uint64_t prev = atomic_fetch_or_explicit(&block->pending_release,
+                                             area_clear_mask,
+                                             memory_order_release);
+    uint64_t released = __builtin_popcountll(area_clear_mask & ~prev) * (partition->blockSize/64);
+    atomic_fetch_add_explicit(&palloc->pending_bytes, (int64_t)released, memory_order_relaxed);
+    atomic_fetch_add_explicit(&palloc->released_bytes, released, memory_order_relaxed);
+    partition_mark_block_free(partition, loc.block);
     
-    if(should_decommit)
+    if(should_decommit && !atomic_load_explicit(&partition_purge_deferred, memory_order_relaxed))
     {
-        uint64_t free_mask = atomic_load(&block->pending_release);
-        uint64_t new_mask = 0ULL;
-        uint64_t region_size = partition->blockSize/64;
-        uintptr_t base_addr = (uintptr_t)(BASE_ADDRESS + loc.partition*PARTITION_SIZE +
-                                          (loc.block * partition->blockSize));
-        uint64_t ranges = atomic_load(&block->ranges);
-        
-        if (atomic_compare_exchange_strong(&block->pending_release, &free_mask, new_mask)) {
-            int32_t region_idx = get_next_mask_idx(free_mask, 0);
-            // find free section.
-            // detach all pools/pages/sections.
-            while (region_idx != -1) {
-                
-                uintptr_t block_addr = base_addr + (region_idx * (region_size));
-                uint32_t size_in_blocks = get_range((uint32_t)region_idx, ranges);
-                uint64_t area_clear_mask =
-                (size_in_blocks == 64 ? ~0ULL : ((1ULL << size_in_blocks) - 1)) << region_idx;
-                // reserve our block.
-                decommit_memory((void*)block_addr, region_size*size_in_blocks);
-                atomic_fetch_and(&block->committed, ~area_clear_mask);
-                
-                // Clear range_mask bits if needed.
-                if (size_in_blocks > 1) {
-                    uint64_t range_clear_mask = (1ULL << region_idx) | (1ULL << (region_idx + size_in_blocks - 1));
-                    atomic_fetch_and_explicit(&block->ranges,
-                                              ~range_clear_mask,
-                                              memory_order_relaxed);
-                }
-                region_idx = get_next_mask_idx(free_mask, region_idx + 1);
-            }
-        }
+        partition_drain_pending(palloc, loc.partition, loc.block);
     }
     return true;
 }
@@ -209,136 +720,354 @@ bool partition_allocator_claim_abandoned(PartitionAllocator* palloc,
     uint64_t abandoned_mask = atomic_load(&block->abandoned);
     uint64_t region_mask = (1ULL << loc.region);
     if ((abandoned_mask & region_mask) != 0) {
-        if(atomic_fetch_and_explicit(&block->abandoned, ~region_mask, memory_order_acquire))
+        // only the thread that clears the bit gets the region.
+        uint64_t prev = atomic_fetch_and_explicit(&block->abandoned, ~region_mask, memory_order_acquire);
+        if ((prev & region_mask) != 0)
         {
+            if ((prev & ~region_mask) == 0) {
+                partition_mark_block_adopted(partition, loc.block);
+            }
             return true; // Successfully claimed the abandoned region
         }
     }
     return false; // Region was not abandoned or already claimed
 }
-// Thread-safe allocation from a partition.
-void* partition_allocator_allocate_from_partition(PartitionAllocator* allocator,
-                                                  int32_t partition_idx,
-                                                  uint32_t num_regions,
-                                                  int32_t* region_idx,
-                                                  int32_t* is_zero,
-                                                  bool zero,
-                                                  bool active) {
-    Partition* partition = &allocator->partitions[partition_idx];
-    // Find and reserve a free block (atomic CAS loop).
-    for (size_t i = 0; i < partition->num_blocks; i++) {
-        PartitionMasks* block = &partition->blocks[i];
-        uint64_t free_mask = atomic_load(&block->reserved);
-        uint64_t region_size = partition->blockSize/64;
-        uintptr_t base_addr = (uintptr_t)(BASE_ADDRESS + partition_idx*PARTITION_SIZE +
-                                  (i * partition->blockSize));
-        if(free_mask == 0)
-        {
-            // Attempt to reserve the bit.
-            uint64_t new_mask = ~0ULL;
-            if (atomic_compare_exchange_strong(&block->reserved, &free_mask, new_mask)) {
-                for (int ii = 0; ii < 64; ii++) {
-                    
-                    uintptr_t block_addr = base_addr + (ii * (region_size));
-                    
-                    // reserve our block.
-                    void* result = alloc_memory((void*)block_addr, region_size, false);
-                    if (result != (void*)block_addr) {
-                        // revert our reservation.
-                        atomic_fetch_and(&block->reserved, ~(1ULL << ii));
-                        free_memory(result, region_size);
-                    }
+
+void* partition_allocator_next_abandoned(PartitionAllocator* palloc,
+                                         int32_t partition_idx,
+                                         void* after)
+{
+    if (palloc == NULL || partition_idx < 0 || partition_idx >= PARTITION_COUNT) {
+        return NULL;
+    }
+    Partition* partition = &palloc->partitions[partition_idx];
+    uint64_t region_size = partition->blockSize/64;
+    uintptr_t partition_base = (uintptr_t)(BASE_ADDRESS + partition_idx*PARTITION_SIZE);
+    // the first region we may return, counted across the partition.
+    size_t from = 0;
+    if (after != NULL) {
+        from = ((uintptr_t)after - partition_base)/region_size + 1;
+    }
+    size_t from_block = from >> 6;
+    size_t from_word = from_block >> 6;
+    size_t num_words = ALIGN_UP_2(partition->num_blocks, 64)/64;
+    uint64_t words = atomic_load(&partition->abandoned_words) &
+                     partition_count_mask(num_words) & ~partition_count_mask(from_word);
+    while (words != 0) {
+        size_t word = (size_t)__builtin_ctzll(words);
+        words &= words - 1;
+        uint64_t blocks = atomic_load(&partition->abandoned_blocks[word]);
+        if (word == from_word) {
+            blocks &= ~partition_count_mask(from_block & 63);
+        }
+        while (blocks != 0) {
+            size_t block_idx = word*64 + (size_t)__builtin_ctzll(blocks);
+            blocks &= blocks - 1;
+            uint64_t regions = atomic_load(&partition->blocks[block_idx].abandoned);
+            if (block_idx == from_block) {
+                regions &= ~partition_count_mask(from & 63);
+            }
+            if (regions != 0) {
+                return (void*)(partition_base + block_idx*partition->blockSize +
+                               (size_t)__builtin_ctzll(regions)*region_size);
+            }
+        }
+    }
+    return NULL;
+}
+// Claim one released range of num_regions without draining the rest.
+static void* partition_reuse_pending(PartitionAllocator* palloc,
+                                     Partition* partition,
+                                     PartitionMasks* block,
+                                     uintptr_t base_addr,
+                                     uint64_t pending,
+                                     uint32_t num_regions,
+                                     int32_t* region_idx)
+{
+    PartitionExtents* extents = partition_extents(partition, block);
+    uint64_t ranges = atomic_load(&extents->ranges);
+    int32_t ridx = get_next_mask_idx(pending, 0);
+    while (ridx != -1) {
+        uint32_t size_in_blocks = get_range((uint32_t)ridx, ranges);
+        if (size_in_blocks == num_regions) {
+            uint64_t area = partition_run_mask((uint32_t)ridx, size_in_blocks);
+            uint64_t prev = atomic_fetch_and(&block->pending_release, ~area);
+            if ((prev & area) == area) {
+                partition_untrack_pending(palloc, partition, area);
+                *region_idx = ridx;
+                return (void*)(base_addr + ridx*(partition->blockSize/64));
+            }
+            // someone else got to it first.
+            atomic_fetch_or(&block->pending_release, prev & area);
+        }
+        ridx = get_next_mask_idx(pending, ridx + size_in_blocks);
+    }
+    return NULL;
+}
+
+// Whether an allocation of area_size can be handed out partly committed.
+static inline bool partition_commits_partial(uint64_t area_size, bool active)
+{
+    return active && partition_commit_step != 0 && partition_commit_step < area_size &&
+           !partition_uses_hugepages(area_size);
+}
+
+// A reused range that is only writable up to an old owner's mark has to be
+// made whole for a caller that doesn't commit as it goes. When that fails
+// the range goes back.
+static bool partition_reuse_commit(PartitionAllocator* palloc,
+                                   Partition* partition,
+                                   PartitionMasks* block,
+                                   uintptr_t base_addr,
+                                   uint64_t area,
+                                   bool partial)
+{
+    if (partial || (area & atomic_load(&block->partial)) == 0) {
+        return true;
+    }
+    uint64_t region_size = partition->blockSize/64;
+    if (partition_commit_area(palloc, block, base_addr, region_size, area, false)) {
+        return true;
+    }
+    PartitionExtents* extents = partition_extents(partition, block);
+    uint64_t marks = partition_range_marks(area, atomic_load(&extents->ranges));
+    if (marks != 0) {
+        atomic_fetch_and_explicit(&extents->ranges, ~marks, memory_order_relaxed);
+    }
+    partition_decommit_area(palloc, block, base_addr, region_size, area);
+    partition_mark_block_free(partition, (size_t)(block - partition->blocks));
+    return false;
+}
+
+static void* partition_allocator_allocate_from_block(PartitionAllocator* palloc,
+                                                     int32_t partition_idx,
+                                                     size_t i,
+                                                     uint32_t num_regions,
+                                                     int32_t* region_idx,
+                                                     int32_t* is_zero,
+                                                     bool zero,
+                                                     bool active)
+{
+    Partition* partition = &palloc->partitions[partition_idx];
+    PartitionMasks* block = &partition->blocks[i];
+    PartitionExtents* extents = partition_extents(partition, block);
+    uint64_t free_mask = atomic_load(&extents->reserved);
+    uint64_t region_size = partition->blockSize/64;
+    uintptr_t base_addr = (uintptr_t)(BASE_ADDRESS + partition_idx*PARTITION_SIZE +
+                              (i * partition->blockSize));
+    bool partial = partition_commits_partial(region_size*num_regions, active);
+    if(free_mask == 0)
+    {
+        // Attempt to reserve the bit.
+        uint64_t new_mask = ~0ULL;
+        if (atomic_compare_exchange_strong(&extents->reserved, &free_mask, new_mask)) {
+            atomic_store_explicit(&partition_layout_locked, true, memory_order_release);
+            // reserve the whole block with a single mapping.
+            void* result = reserve_memory((void*)base_addr, partition->blockSize);
+            if (result != (void*)base_addr) {
+                // someone else owns part of this range, never hand it out.
+                if (result != NULL) {
+                    free_memory(result, partition->blockSize);
                 }
+                atomic_store(&block->committed, ~0ULL);
+                return NULL;
+            }
+            atomic_fetch_add_explicit(&palloc->vma_count, 1, memory_order_relaxed);
+        }
+    }
+    else
+    {
+        
+        free_mask = atomic_load(&block->pending_release);
+        uint64_t new_mask = 0ULL;
+        if(free_mask != 0 && atomic_load_explicit(&partition_purge_deferred, memory_order_relaxed))
+        {
+            // leave the purging to the maintenance thread, only pick out
+            // a released range that fits.
+            void* reused = NULL;
+            if (!zero) {
+                reused = partition_reuse_pending(palloc, partition, block, base_addr, free_mask, num_regions, region_idx);
+            }
+            if (reused != NULL &&
+                !partition_reuse_commit(palloc, partition, block, base_addr,
+                                        partition_run_mask((uint32_t)*region_idx, num_regions), partial)) {
+                reused = NULL;
+            }
+            if (reused != NULL) {
+                *is_zero = 0;
+                return reused;
             }
         }
-        else
+        else if(free_mask != 0)
         {
-            
-            free_mask = atomic_load(&block->pending_release);
-            uint64_t new_mask = 0ULL;
-            if(free_mask != 0)
-            {
-                if (atomic_compare_exchange_strong(&block->pending_release, &free_mask, new_mask)) {
-                    uint64_t ranges = atomic_load(&block->ranges);
-                    int32_t region_idx = get_next_mask_idx(free_mask, 0);
-                    uintptr_t reused_block = 0;
-                    while (region_idx != -1) {
-                        
-                        uintptr_t block_addr = base_addr + (region_idx * (region_size));
-                        uint32_t size_in_blocks = get_range((uint32_t)region_idx, ranges);
-                        uint64_t area_clear_mask =
-                        (size_in_blocks == 64 ? ~0ULL : ((1ULL << size_in_blocks) - 1)) << region_idx;
-                        if(reused_block == 0 && size_in_blocks == num_regions && !zero)
-                        {
-                            // lets reclaim a region
-                            reused_block = block_addr;  
-                        }
-                        else
-                        {
-                            decommit_memory((void*)block_addr, region_size*size_in_blocks);
-                            atomic_fetch_and(&block->committed, ~area_clear_mask);
-                            if (size_in_blocks > 1) {
-                                uint64_t range_clear_mask = (1ULL << region_idx) | (1ULL << (region_idx + size_in_blocks - 1));
-                                atomic_fetch_and_explicit(&block->ranges,
-                                                        ~range_clear_mask,
-                                                        memory_order_relaxed);
-                            }
-                        }
-                        
-                        region_idx = get_next_mask_idx(free_mask, region_idx + 1);
+            if (atomic_compare_exchange_strong(&block->pending_release, &free_mask, new_mask)) {
+                partition_untrack_pending(palloc, partition, free_mask);
+                uint64_t ranges = atomic_load(&extents->ranges);
+                int32_t ridx = get_next_mask_idx(free_mask, 0);
+                uintptr_t reused_block = 0;
+                uint64_t decommit_mask = 0;
+                while (ridx != -1) {
+                    
+                    uintptr_t block_addr = base_addr + (ridx * (region_size));
+                    uint32_t size_in_blocks = get_range((uint32_t)ridx, ranges);
+                    uint64_t area_clear_mask =
+                    (size_in_blocks == 64 ? ~0ULL : ((1ULL << size_in_blocks) - 1)) << ridx;
+                    if(reused_block == 0 && size_in_blocks == num_regions && !zero)
+                    {
+                        // lets reclaim a region
+                        reused_block = block_addr;
+                        *region_idx = ridx;
                     }
-                    if(reused_block != 0)
+                    else
                     {
-                        // We successfully reclaimed a region
-                        *is_zero = 0;
-                        return (void*)reused_block;
+                        decommit_mask |= area_clear_mask;
                     }
+                    
+                    ridx = get_next_mask_idx(free_mask, ridx + size_in_blocks);
+                }
+                uint64_t range_clear_mask = partition_range_marks(decommit_mask, ranges);
+                if (range_clear_mask != 0) {
+                    atomic_fetch_and_explicit(&extents->ranges,
+                                              ~range_clear_mask,
+                                              memory_order_relaxed);
+                }
+                partition_decommit_area(palloc, block, base_addr, region_size, decommit_mask);
+                if(reused_block != 0 &&
+                   !partition_reuse_commit(palloc, partition, block, base_addr,
+                                           partition_run_mask((uint32_t)*region_idx, num_regions), partial))
+                {
+                    reused_block = 0;
+                }
+                if(reused_block != 0)
+                {
+                    // We successfully reclaimed a region
+                    *is_zero = 0;
+                    return (void*)reused_block;
                 }
             }
-        
         }
-        free_mask = atomic_load(&block->committed);
-        // Find first zero bit (free block).
-        int bit = find_first_nzeros(free_mask, num_regions, 0);
-        if (bit < 0) continue;  // No free blocks in this chunk.
+    
+    }
+    free_mask = atomic_load(&block->committed);
+    // Find first zero bit (free block).
+    int bit = find_first_nzeros(free_mask, num_regions, 0);
+    if (bit < 0) return NULL;  // No free blocks in this chunk.
 
+    
+    // Attempt to reserve the bits.
+    uint64_t area_mask = (num_regions == 64 ? ~0ULL : ((1ULL << num_regions) - 1)) << bit;
+    uint64_t new_mask = free_mask | area_mask;
+    if (atomic_compare_exchange_strong(&block->committed, &free_mask, new_mask)) {
+        // Calculate the block's address.
+        uintptr_t block_addr = base_addr + (bit * (region_size));
+
+        // regions purged lazily may still hold their old contents.
+        bool was_writable = (atomic_load(&block->writable) & area_mask) != 0;
+        // Commit memory (if requested).
+        if (!partition_commit_area(palloc, block, base_addr, region_size, area_mask, partial)) {
+            // Failed to commit; revert the bitmask.
+            atomic_fetch_and(&block->committed, ~area_mask);
+            return NULL;
+        }
+        if(active)
+        {
+            atomic_fetch_or_explicit(&block->active,
+                                     area_mask,
+                                     memory_order_relaxed);
+        }
         
-        // Attempt to reserve the bit.
-        uint64_t new_mask = free_mask | (1ULL << bit);
-        if (atomic_compare_exchange_strong(&block->committed, &free_mask, new_mask)) {
-            // Calculate the block's address.
-            uintptr_t block_addr = base_addr + (bit * (region_size));
-
-            // Commit memory (if requested).
-            if (!commit_memory((void*)block_addr, region_size)) {
-                // Failed to commit; revert the bitmask.
-                atomic_fetch_and(&block->committed, ~(1ULL << bit));
-                return NULL;
-            }
-            if(active)
-            {
-                atomic_fetch_or_explicit(&block->active,
-                                         free_mask,
-                                         memory_order_relaxed);
-            }
-            
-            // Set range_mask bits if needed.
-            if (num_regions > 1) {
-                uint64_t range_add_mask = (1ULL << bit) | (1ULL << (bit + num_regions - 1));
-                atomic_fetch_or_explicit(&block->ranges,
-                                          range_add_mask,
-                                          memory_order_relaxed);
+        // Set range_mask bits if needed.
+        if (num_regions > 1) {
+            uint64_t range_add_mask = (1ULL << bit) | (1ULL << (bit + num_regions - 1));
+            atomic_fetch_or_explicit(&extents->ranges,
+                                      range_add_mask,
+                                      memory_order_relaxed);
+        }
+        // update commit mask.
+        *region_idx = bit;
+        *is_zero = !(was_writable && partition_purge_lazy);
+        return (void*)block_addr;
+    }
+    // CAS failed (another thread took the block).
+    return NULL;
+}
+
+static inline void* partition_allocator_try_block(PartitionAllocator* allocator,
+                                                  int32_t partition_idx,
+                                                  size_t i,
+                                                  uint32_t num_regions,
+                                                  int32_t* region_idx,
+                                                  int32_t* is_zero,
+                                                  bool zero,
+                                                  bool active)
+{
+    Partition* partition = &allocator->partitions[partition_idx];
+    void* result = partition_allocator_allocate_from_block(allocator, partition_idx, i,
+                                                           num_regions, region_idx,
+                                                           is_zero, zero, active);
+    if (partition_block_is_full(&partition->blocks[i])) {
+        partition_mark_block_full(partition, i);
+    }
+    return result;
+}
+
+// Search the blocks the summary says may have room, starting at block
+// start and wrapping around, so every caller begins somewhere else.
+static void* partition_allocator_allocate_near(PartitionAllocator* allocator,
+                                               int32_t partition_idx,
+                                               size_t start,
+                                               uint32_t num_regions,
+                                               int32_t* region_idx,
+                                               int32_t* is_zero,
+                                               bool zero,
+                                               bool active,
+                                               size_t* found)
+{
+    Partition* partition = &allocator->partitions[partition_idx];
+    size_t num_words = ALIGN_UP_2(partition->num_blocks, 64)/64;
+    size_t start_word = start >> 6;
+    uint64_t above = ~0ULL << (start & 63);
+    // the start word is visited twice, first from start up, and last
+    // for whatever lies below start.
+    for (size_t k = 0; k <= num_words; k++) {
+        size_t w = (start_word + k) % num_words;
+        if ((partition_free_words(partition) & (1ULL << w)) == 0) {
+            continue;
+        }
+        uint64_t free_blocks = partition_free_blocks(partition, w);
+        if (k == 0) {
+            free_blocks &= above;
+        } else if (k == num_words) {
+            free_blocks &= ~above;
+        }
+        while (free_blocks != 0) {
+            size_t i = (w << 6) + __builtin_ctzll(free_blocks);
+            free_blocks &= free_blocks - 1;
+            void* result = partition_allocator_try_block(allocator, partition_idx, i,
+                                                         num_regions, region_idx,
+                                                         is_zero, zero, active);
+            if (result != NULL) {
+                *found = i;
+                return result;
             }
-            // update commit mask.
-            *region_idx = bit;
-            *is_zero = 1;
-            return (void*)block_addr;
         }
-        // CAS failed (another thread took the block); retry.
     }
     return NULL;  // No free blocks in the entire partition.
 }
 
+// Thread-safe allocation from a partition.
+void* partition_allocator_allocate_from_partition(PartitionAllocator* allocator,
+                                                  int32_t partition_idx,
+                                                  uint32_t num_regions,
+                                                  int32_t* region_idx,
+                                                  int32_t* is_zero,
+                                                  bool zero,
+                                                  bool active) {
+    size_t found = 0;
+    return partition_allocator_allocate_near(allocator, partition_idx, 0, num_regions,
+                                             region_idx, is_zero, zero, active, &found);
+}
+
 PartitionMasks* get_partition_masks(PartitionAllocator* allocator, void* addr,
                                     uint32_t* sub_idx) {
     // Convert address to integer and validate range
@@ -350,7 +1079,7 @@ PartitionMasks* get_partition_masks(PartitionAllocator* allocator, void* addr,
 
     // Calculate partition index (large partitions)
     uintptr_t offset = p - (uintptr_t)BASE_ADDRESS;
-    int32_t partition_id = (int32_t)(offset / PARTITION_SIZE);
+    int32_t partition_id = (int32_t)(offset >> PARTITION_SIZE_EXP);
     
     if (partition_id < 0 || partition_id >= PARTITION_COUNT) {
         return NULL;
@@ -360,7 +1089,7 @@ PartitionMasks* get_partition_masks(PartitionAllocator* allocator, void* addr,
     Partition* partition = &allocator->partitions[partition_id];
     
     // Calculate large block index within partition
-    uintptr_t partition_offset = offset % PARTITION_SIZE;
+    uintptr_t partition_offset = offset & (PARTITION_SIZE - 1);
     uint32_t block_index = (uint32_t)(partition_offset / partition->blockSize);
     
     if (block_index >= partition->num_blocks) {
@@ -388,7 +1117,7 @@ int32_t get_partition_location(PartitionAllocator* allocator, void* addr, Partit
     
     // Calculate partition index (large partitions)
     uintptr_t offset = p - (uintptr_t)BASE_ADDRESS;
-    int32_t partition_id = (int32_t)(offset / PARTITION_SIZE);
+    int32_t partition_id = (int32_t)(offset >> PARTITION_SIZE_EXP);
     
     if (partition_id < 0 || partition_id >= PARTITION_COUNT) {
         return -1;
@@ -398,7 +1127,7 @@ int32_t get_partition_location(PartitionAllocator* allocator, void* addr, Partit
     Partition* partition = &allocator->partitions[partition_id];
     
     // Calculate large block index within partition
-    uintptr_t partition_offset = offset % PARTITION_SIZE;
+    uintptr_t partition_offset = offset & (PARTITION_SIZE - 1);
     uint32_t block_index = (uint32_t)(partition_offset / partition->blockSize);
     
     if (block_index >= partition->num_blocks) {
@@ -424,10 +1153,224 @@ void* partition_allocator_get_free_region(PartitionAllocator* allocator,
                                           int32_t* region_idx,
                                           int32_t* is_zero,
                                           bool zero,
-                                          bool active )
+                                          bool active,
+                                          int32_t* home_block)
+{
+    Partition* partition = &allocator->partitions[partition_idx];
+    if (partition_placement == PLACEMENT_ADDRESS_ORDERED) {
+        // the lowest block with room, so the blocks above it drain.
+        size_t found = 0;
+        void* result = partition_allocator_allocate_near(allocator, partition_idx, 0, num_regions,
+                                                         region_idx, is_zero, zero, active, &found);
+        if (result != NULL) {
+            *home_block = (int32_t)found;
+        }
+        return result;
+    }
+    if (*home_block < 0) {
+        // hand out homes in turn, so threads start on blocks of their own.
+        uint32_t next = atomic_fetch_add_explicit(&partition->next_home, 1, memory_order_relaxed);
+        *home_block = (int32_t)(next % partition->num_blocks);
+    }
+    size_t home = (size_t)*home_block;
+    // the home block first, whatever the summary says about it.
+    void* result = partition_allocator_try_block(allocator, partition_idx, home,
+                                                 num_regions, region_idx,
+                                                 is_zero, zero, active);
+    if (result != NULL) {
+        return result;
+    }
+    // the home block is exhausted, steal from the closest block after it
+    // and make that the new home.
+    size_t found = home;
+    result = partition_allocator_allocate_near(allocator, partition_idx, home, num_regions,
+                                               region_idx, is_zero, zero, active, &found);
+    if (result != NULL) {
+        *home_block = (int32_t)found;
+    }
+    return result;
+}
+
+size_t partition_allocator_vma_count(PartitionAllocator* palloc)
+{
+    if(palloc == NULL)
+    {
+        return 0;
+    }
+    int64_t count = atomic_load_explicit(&palloc->vma_count, memory_order_relaxed);
+    return count < 0 ? 0 : (size_t)count;
+}
+
+void partition_allocator_set_purge_mode(purge_mode mode, bool batched)
+{
+    partition_purge_mode = mode;
+    if (mode == PURGE_FREE) {
+        partition_purge_lazy = true;
+    }
+#if defined(PURGE_BATCH_SUPPORTED)
+    if (batched && partition_pidfd < 0) {
+        partition_pidfd = (int)syscall(SYS_pidfd_open, getpid(), 0);
+    }
+    partition_purge_batched = batched && partition_pidfd >= 0;
+#else
+    UNUSED(batched);
+#endif
+}
+
+bool partition_allocator_purge_pages(void* addr, size_t size)
+{
+#if defined(WINDOWS) || defined(__APPLE__)
+    // purging decommits here, and the pages have to stay writable.
+    reset_memory(addr, size);
+    return false;
+#else
+    purge_mode mode = partition_purge_mode == PURGE_FREE ? PURGE_FREE : PURGE_DONTNEED;
+    return purge_memory(addr, size, mode) && mode == PURGE_DONTNEED;
+#endif
+}
+
+void partition_allocator_set_hugepages(hugepage_mode mode, size_t threshold)
+{
+    partition_hugepage_mode = mode;
+    partition_hugepage_threshold = MAX(threshold, HUGE_PAGE_SIZE);
+}
+
+void partition_allocator_set_placement(placement_policy policy)
 {
-    return partition_allocator_allocate_from_partition(allocator, partition_idx, num_regions, region_idx, is_zero, zero, active);
+    partition_placement = policy;
 }
 
+placement_policy partition_allocator_get_placement(void)
+{
+    return partition_placement;
+}
 
+void partition_allocator_set_commit_step(size_t step)
+{
+    if (step != 0 && step < os_page_size) {
+        step = os_page_size;
+    }
+    // the marks are rounded up to steps, so keep them a power of two.
+    partition_commit_step = step == 0 || POWER_OF_TWO(step) ? step : 1ULL << (64 - __builtin_clzll(step));
+}
 
+uint64_t partition_allocator_initial_commit(uint64_t region_size)
+{
+    return partition_commits_partial(region_size, true) ? partition_commit_step : region_size;
+}
+
+bool partition_allocator_commit_to(void* region, _Atomic(uint64_t)* mark, uint64_t end)
+{
+    uint64_t region_size = area_size_from_addr((uintptr_t)region);
+    uint64_t from = atomic_load_explicit(mark, memory_order_relaxed);
+    if (end <= from) {
+        return true;
+    }
+    // with the step turned off since, the rest goes in one go.
+    uint64_t step = partition_commit_step == 0 ? region_size : partition_commit_step;
+    uint64_t to = MIN(ALIGN_UP_2(end, step), region_size);
+    if (!commit_memory((uint8_t*)region + from, to - from)) {
+        return false;
+    }
+    // committing twice does no harm, the mark only moves up.
+    while (from < to &&
+           !atomic_compare_exchange_weak_explicit(mark, &from, to, memory_order_relaxed, memory_order_relaxed)) {
+    }
+    return true;
+}
+
+size_t partition_allocator_purge_granule(int32_t partition_idx)
+{
+    if (partition_uses_hugepages(region_size_from_partition_id(partition_idx))) {
+        return HUGE_PAGE_SIZE;
+    }
+    return os_page_size;
+}
+
+bool partition_allocator_decommit_pending(PartitionAllocator* palloc)
+{
+    if(palloc == NULL)
+    {
+        return false;
+    }
+    bool released = false;
+    for (int32_t p = 0; p < PARTITION_COUNT; p++) {
+        Partition* partition = &palloc->partitions[p];
+        uint64_t region_size = partition->blockSize/64;
+        for (size_t i = 0; i < partition->num_blocks; i++) {
+            PartitionMasks* block = &partition->blocks[i];
+            PartitionExtents* extents = partition_extents(partition, block);
+            if (atomic_load(&extents->reserved) == 0) {
+                continue;
+            }
+            uintptr_t base_addr = (uintptr_t)(BASE_ADDRESS + p*PARTITION_SIZE +
+                                              (i * partition->blockSize));
+            uint64_t pending = partition_take_pending(palloc, partition, block);
+            if (pending != 0) {
+                atomic_fetch_and(&block->committed, ~pending);
+                partition_mark_block_free(partition, i);
+            }
+            // claim the idle writable regions like an allocation would, so
+            // nobody commits into them while their rights are dropped.
+            uint64_t committed = atomic_load(&block->committed);
+            uint64_t idle = atomic_load(&block->writable) & ~committed;
+            while (idle != 0 &&
+                   !atomic_compare_exchange_weak(&block->committed, &committed, committed | idle)) {
+                idle = atomic_load(&block->writable) & ~committed;
+            }
+            if (idle == 0) {
+                continue;
+            }
+            partition_protect_area(palloc, block, base_addr, region_size, idle);
+            atomic_fetch_and(&block->committed, ~idle);
+            released = true;
+        }
+    }
+    return released;
+}
+
+void partition_allocator_defer_purge(bool deferred)
+{
+    atomic_store(&partition_purge_deferred, deferred);
+}
+
+// Drain blocks with pending releases until at least max_bytes have been
+// purged. Returns the bytes purged.
+size_t partition_allocator_purge_pending(PartitionAllocator* palloc, size_t max_bytes)
+{
+    if(palloc == NULL)
+    {
+        return 0;
+    }
+    size_t purged = 0;
+    for (int32_t p = 0; p < PARTITION_COUNT && purged < max_bytes; p++) {
+        Partition* partition = &palloc->partitions[p];
+        // blocks with something pending are always marked free.
+        uint64_t words = partition_free_words(partition);
+        while (words != 0 && purged < max_bytes) {
+            size_t w = __builtin_ctzll(words);
+            words &= words - 1;
+            uint64_t free_blocks = partition_free_blocks(partition, w);
+            while (free_blocks != 0 && purged < max_bytes) {
+                size_t i = (w << 6) + __builtin_ctzll(free_blocks);
+                free_blocks &= free_blocks - 1;
+                if (atomic_load(&partition->blocks[i].pending_release) == 0) {
+                    continue;
+                }
+                purged += partition_drain_pending(palloc, (uint32_t)p, i);
+            }
+        }
+    }
+    return purged;
+}
+
+size_t partition_allocator_pending_bytes(PartitionAllocator* palloc)
+{
+    int64_t pending = atomic_load_explicit(&palloc->pending_bytes, memory_order_relaxed);
+    return pending < 0 ? 0 : (size_t)pending;
+}
+
+uint64_t partition_allocator_released_bytes(PartitionAllocator* palloc)
+{
+    return atomic_load_explicit(&palloc->released_bytes, memory_order_relaxed);
+}
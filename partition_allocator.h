@@ -10,6 +10,9 @@ typedef struct
 } PartitionLoc;
 
 PartitionAllocator* partition_allocator__create(void);
+// Move the partitions before anything has been reserved in them. Falls
+// back to a higher base or smaller partitions when the range is taken.
+bool partition_allocator_set_layout(PartitionAllocator* palloc, uintptr_t base, size_t partition_size);
 void* partition_allocator_allocate_from_partition(PartitionAllocator* allocator,
                                                   int32_t partition_idx,
                                                   uint32_t num_regions,
@@ -18,13 +21,16 @@ void* partition_allocator_allocate_from_partition(PartitionAllocator* allocator,
                                                   bool zero,
                                                   bool active);
 PartitionMasks* get_partition_masks(PartitionAllocator* allocator, void* addr, uint32_t* sub_idx);
+// home_block is the caller's block in this partition, -1 if it has none
+// yet. It is updated when the search has to move on.
 void* partition_allocator_get_free_region(PartitionAllocator* allocator,
                                           int32_t partition_idx,
                                           uint32_t num_regions,
                                           int32_t* region_idx,
                                           int32_t* is_zero,
                                           bool zero,
-                                          bool active);
+                                          bool active,
+                                          int32_t* home_block);
 
 bool partition_allocator_free_blocks(PartitionAllocator* palloc,
                                      void* addr,
@@ -35,6 +41,36 @@ bool partition_allocator_claim_abandoned(PartitionAllocator* palloc,
                                                   void* addr);
 bool partition_allocator_abandon_blocks(PartitionAllocator* palloc,
                                      void* addr);
+// the first abandoned region of the partition past after, NULL starts at
+// the bottom. A summary of the abandoned masks keeps this cheap when few
+// blocks have any. The region still has to be claimed.
+void* partition_allocator_next_abandoned(PartitionAllocator* palloc,
+                                         int32_t partition_idx,
+                                         void* after);
 bool partition_allocator_reset_block(PartitionAllocator* palloc,
                                      void* addr);
+size_t partition_allocator_vma_count(PartitionAllocator* palloc);
+void partition_allocator_set_purge_mode(purge_mode mode, bool batched);
+void partition_allocator_set_hugepages(hugepage_mode mode, size_t threshold);
+void partition_allocator_set_placement(placement_policy policy);
+placement_policy partition_allocator_get_placement(void);
+// smallest range a purge inside a region of this partition may cover
+// without splitting a huge page.
+size_t partition_allocator_purge_granule(int32_t partition_idx);
+// Regions handed out to arenas and implicit lists are made writable a step
+// at a time as they fill up, 0 commits them whole. Set it before the first
+// allocation.
+void partition_allocator_set_commit_step(size_t step);
+// how much of a fresh arena or implicit list region is writable.
+uint64_t partition_allocator_initial_commit(uint64_t region_size);
+// grow the writable part of a region to cover end bytes from its start,
+// mark holds how far it reaches.
+bool partition_allocator_commit_to(void* region, _Atomic(uint64_t)* mark, uint64_t end);
+// give back the pages of a range inside a region that stays in use.
+// true when the range reads back as zero.
+bool partition_allocator_purge_pages(void* addr, size_t size);
+void partition_allocator_defer_purge(bool deferred);
+size_t partition_allocator_purge_pending(PartitionAllocator* palloc, size_t max_bytes);
+size_t partition_allocator_pending_bytes(PartitionAllocator* palloc);
+uint64_t partition_allocator_released_bytes(PartitionAllocator* palloc);
 #endif
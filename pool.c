@@ -1,10 +1,19 @@
 #include "pool.h"
+#include "partition_allocator.h"
+
+// when set, the blocks of new pools start on the page after the header.
+static bool pool_pad_header = false;
+
+void pool_set_header_padding(bool pad)
+{
+    pool_pad_header = pad;
+}
 
 void pool_init(Pool *p, const uint8_t pidx, const uint32_t block_idx, const int32_t psize)
 {
     p->idx = pidx << 4 | SLOT_POOL;
     p->block_idx = block_idx;
-    p->block_size = pool_sizes[block_idx];
+    p->block_size = pool_block_size(block_idx);
     p->num_committed = 0;
     p->alignment = (uint32_t)(1ULL << __builtin_ctzll(p->block_size));
     p->thread_free_counter = 0;
@@ -14,11 +23,15 @@ void pool_init(Pool *p, const uint8_t pidx, const uint32_t block_idx, const int3
     p->next = NULL;
     p->prev = NULL;
     p->free = NULL;
+    p->purged = 0;
+    p->bin = POOL_EMPTY;
     
+    size_t data_align = pool_pad_header ? MAX(p->alignment, os_page_size) : p->alignment;
+    p->data_offset = (int32_t)(ALIGN_UP_2((uintptr_t)p + sizeof(Pool), data_align) - (uintptr_t)p);
     void *blocks = pool_base_address(p);
     const uintptr_t section_end = ALIGN_UP_2((uintptr_t)blocks, psize);
     
-    const size_t block_memory = psize - ALIGN_UP_2(sizeof(Pool), p->alignment);
+    const size_t block_memory = psize - p->data_offset;
     const size_t remaining_size = section_end - (uintptr_t)blocks;
     p->num_available = (uint32_t)(MIN(remaining_size, block_memory)/p->block_size);
 }
@@ -45,21 +58,246 @@ void pool_thread_free_batch(Pool* pool, Block* head, Block* tail, uint32_t num)
 
 // Moves all thread_free blocks to deferred_free (call from owning thread)
 void pool_claim_thread_frees(Pool* pool) {
-    uint64_t thread_free_count = atomic_load(&pool->thread_free_counter);
     // Atomically extract the entire thread_free list
     Block* head = atomic_exchange_explicit(
         &pool->thread_free,
         NULL,
         memory_order_acquire  // Ensures we see all prior releases
     );
-    atomic_fetch_sub_explicit(&pool->thread_free_counter, thread_free_count, memory_order_relaxed);
     // Prepend to deferred_free (no atomic needed - owner thread only)
     if (head) {
+        int32_t num = 1;
         Block* tail = head;
         while (tail->next) {
             tail = tail->next;
+            num++;
         }
         tail->next = pool->deferred_free;
         pool->deferred_free = head;
+        // the counter runs ahead of the list, so only what we took comes off.
+        atomic_fetch_sub_explicit(&pool->thread_free_counter, num, memory_order_relaxed);
+        pool->num_used -= num;
+    }
+}
+// Each bit of purged covers a 64th of the pool.
+static inline uint32_t pool_unit_shift(Pool* p)
+{
+    return ARENA_CHUNK_SIZE_EXPONENT(partition_id_from_addr((uintptr_t)p)) - 6;
+}
+
+// The units a range of blocks touches.
+static inline uint64_t pool_block_units(Pool* p, uint32_t shift, int32_t first, int32_t last)
+{
+    uintptr_t base = (uintptr_t)pool_base_address(p) - (uintptr_t)p;
+    uint32_t lo = (uint32_t)((base + first * p->block_size) >> shift);
+    uint32_t hi = (uint32_t)((base + last * p->block_size - 1) >> shift);
+    uint64_t len = hi - lo + 1;
+    return (len >= 64 ? ~0ULL : ((1ULL << len) - 1)) << lo;
+}
+
+// Clear units from purged. Blocks below num_committed that no longer touch
+// a purged unit go back on the free list, except for [skip_first, skip_last)
+// which the caller is about to hand out.
+static void pool_unpurge(Pool* p, uint64_t units, int32_t skip_first, int32_t skip_last)
+{
+    units &= p->purged;
+    if (units == 0) {
+        return;
+    }
+    p->purged &= ~units;
+    uint32_t shift = pool_unit_shift(p);
+    uintptr_t base = (uintptr_t)pool_base_address(p) - (uintptr_t)p;
+    uintptr_t lo = (uintptr_t)__builtin_ctzll(units) << shift;
+    uintptr_t hi = (uintptr_t)(64 - __builtin_clzll(units)) << shift;
+    int32_t first = lo > base ? (int32_t)((lo - base) / p->block_size) : 0;
+    int32_t last = hi > base ? (int32_t)((hi - base + p->block_size - 1) / p->block_size) : 0;
+    last = MIN(last, p->num_committed);
+    uint8_t* blocks = pool_base_address(p);
+    for (int32_t i = last - 1; i >= first; i--) {
+        if (i >= skip_first && i < skip_last) {
+            continue;
+        }
+        uint64_t touched = pool_block_units(p, shift, i, i + 1);
+        if ((touched & units) != 0 && (touched & p->purged) == 0) {
+            Block* block = (Block*)(blocks + i * p->block_size);
+            block->next = p->free;
+            p->free = block;
+        }
+    }
+}
+
+void pool_unpurge_blocks(Pool* p, int32_t first, int32_t last)
+{
+    pool_unpurge(p, pool_block_units(p, pool_unit_shift(p), first, last), first, last);
+}
+
+void pool_unpurge_all(Pool* p)
+{
+    pool_unpurge(p, ~0ULL, 0, 0);
+}
+
+static inline void pool_add_free_range(uint32_t* free_bytes, uint32_t shift, uintptr_t lo, uintptr_t hi)
+{
+    while (lo < hi) {
+        uintptr_t unit_end = ((lo >> shift) + 1) << shift;
+        uintptr_t end = MIN(unit_end, hi);
+        free_bytes[lo >> shift] += (uint32_t)(end - lo);
+        lo = end;
+    }
+}
+
+// Drop the blocks that touch a purged unit from a free list.
+static inline Block* pool_filter_free_list(Pool* p, uint32_t shift, Block* head)
+{
+    uint8_t* blocks = pool_base_address(p);
+    Block** link = &head;
+    while (*link != NULL) {
+        int32_t idx = (int32_t)(((uint8_t*)*link - blocks) / p->block_size);
+        if (pool_block_units(p, shift, idx, idx + 1) & p->purged) {
+            *link = (*link)->next;
+        } else {
+            link = &(*link)->next;
+        }
+    }
+    return head;
+}
+
+// Give back the pages that only hold free blocks. Blocks on the free
+// lists and past num_committed count as free, blocks other threads have
+// freed still count as used until they are claimed. Purged blocks are
+// taken off the free lists and only come back once nothing else is left,
+// or when the bump pointer reaches them.
+// Owner thread only, and not while the pool is the current slot.
+size_t pool_purge_free_pages(Pool* p)
+{
+    int32_t pid = partition_id_from_addr((uintptr_t)p);
+    uint32_t shift = pool_unit_shift(p);
+    size_t pool_size = 64ULL << shift;
+    size_t granule = MAX((1ULL << shift), partition_allocator_purge_granule(pid));
+    if (granule >= pool_size) {
+        return 0;
+    }
+    uint32_t free_bytes[64] = {0};
+    uintptr_t base = (uintptr_t)pool_base_address(p) - (uintptr_t)p;
+    uint8_t* blocks = pool_base_address(p);
+    // the alignment gap after the header, the bump tail and the slack at the end.
+    pool_add_free_range(free_bytes, shift, sizeof(Pool), base);
+    pool_add_free_range(free_bytes, shift, base + p->num_committed * p->block_size, pool_size);
+    Block* lists[2] = {p->free, p->deferred_free};
+    for (int l = 0; l < 2; l++) {
+        for (Block* b = lists[l]; b != NULL; b = b->next) {
+            uintptr_t off = (uintptr_t)((uint8_t*)b - blocks) + base;
+            pool_add_free_range(free_bytes, shift, off, off + p->block_size);
+        }
+    }
+    uint64_t free_units = 0;
+    for (uint32_t u = 0; u < 64; u++) {
+        if (free_bytes[u] == (1U << shift)) {
+            free_units |= 1ULL << u;
+        }
+    }
+    // whole granules only, the one with the header never goes.
+    uint32_t per = (uint32_t)(granule >> shift);
+    uint64_t header = per >= 64 ? ~0ULL : (1ULL << per) - 1;
+    uint64_t purge = mask_whole_groups(free_units, per) & ~header & ~p->purged;
+    if (purge == 0) {
+        return 0;
+    }
+    // the lists run through the blocks, unlink them while they can still be read.
+    p->purged |= purge;
+    p->free = pool_filter_free_list(p, shift, p->free);
+    p->deferred_free = pool_filter_free_list(p, shift, p->deferred_free);
+    size_t purged = 0;
+    while (purge != 0) {
+        uint32_t start = __builtin_ctzll(purge);
+        uint64_t rest = ~(purge >> start);
+        uint32_t len = rest == 0 ? 64 - start : (uint32_t)__builtin_ctzll(rest);
+        partition_allocator_purge_pages((uint8_t*)p + ((size_t)start << shift), (size_t)len << shift);
+        purged += (size_t)len << shift;
+        purge &= ~((len == 64 ? ~0ULL : ((1ULL << len) - 1)) << start);
+    }
+    return purged;
+}
+
+// exact size classes on top of the fixed table. append only, so the index
+// of a class never changes while its pools are around.
+int32_t pool_custom_sizes[POOL_CUSTOM_COUNT];
+_Atomic(int32_t) pool_custom_count = 0;
+
+bool pool_add_size_class(size_t size)
+{
+    size = ALIGN(size);
+    if (size == 0 || size > (size_t)pool_sizes[POOL_FIXED_COUNT - 1]) {
+        return false;
+    }
+    if (pool_block_size(size_to_pool(size)) == (int32_t)size) {
+        return true;
+    }
+    int32_t count = atomic_load_explicit(&pool_custom_count, memory_order_relaxed);
+    if (count == POOL_CUSTOM_COUNT) {
+        return false;
     }
-}
\ No newline at end of file
+    pool_custom_sizes[count] = (int32_t)size;
+    atomic_store_explicit(&pool_custom_count, count + 1, memory_order_release);
+    return true;
+}
+
+// request counts per 8 byte step, up to the largest pool class.
+#define POOL_PROFILE_BUCKETS (32768 / 8 + 1)
+static _Atomic(uint64_t) pool_profile[POOL_PROFILE_BUCKETS];
+bool pool_profiling = false;
+
+void pool_profile_record(size_t size)
+{
+    if (size <= (size_t)pool_sizes[POOL_FIXED_COUNT - 1]) {
+        atomic_fetch_add_explicit(&pool_profile[ALIGN(size) >> 3], 1, memory_order_relaxed);
+    }
+}
+
+// Greedy pick of the classes that save the most internal fragmentation.
+// A new class c between the classes below and top takes the requests in
+// (below, c], and saves top - c bytes on each of them.
+size_t pool_suggest_size_classes(size_t *classes, size_t *saved, size_t max_classes)
+{
+    bool is_class[POOL_PROFILE_BUCKETS] = {false};
+    uint64_t hist[POOL_PROFILE_BUCKETS];
+    for (size_t b = 0; b < POOL_PROFILE_BUCKETS; b++) {
+        hist[b] = atomic_load_explicit(&pool_profile[b], memory_order_relaxed);
+    }
+    for (size_t i = 0; i < POOL_BIN_COUNT; i++) {
+        if (i < POOL_FIXED_COUNT || (int32_t)(i - POOL_FIXED_COUNT) < atomic_load(&pool_custom_count)) {
+            is_class[pool_block_size((uint32_t)i) >> 3] = true;
+        }
+    }
+    size_t found = 0;
+    while (found < max_classes) {
+        uint64_t best_gain = 0;
+        size_t best = 0;
+        size_t below = 0;
+        for (size_t top = 1; top < POOL_PROFILE_BUCKETS; top++) {
+            if (!is_class[top]) {
+                continue;
+            }
+            uint64_t requests = 0;
+            for (size_t c = below + 1; c < top; c++) {
+                requests += hist[c];
+                uint64_t gain = requests * ((top - c) << 3);
+                if (gain > best_gain) {
+                    best_gain = gain;
+                    best = c;
+                }
+            }
+            below = top;
+        }
+        if (best_gain == 0) {
+            break;
+        }
+        is_class[best] = true;
+        classes[found] = best << 3;
+        if (saved != NULL) {
+            saved[found] = best_gain;
+        }
+        found++;
+    }
+    return found;
+}
@@ -26,10 +26,21 @@ static const int32_t pool_sizes[] = {
     };    // 256m     // rounds to 4m
 
 void pool_init(Pool *p, const uint8_t pidx, const uint32_t block_idx, const int32_t psize);
+void pool_set_header_padding(bool pad);
 void pool_thread_free_batch(Pool* pool, Block* head, Block* tail, uint32_t num);
 void pool_claim_thread_frees(Pool* pool);
+size_t pool_purge_free_pages(Pool* p);
+void pool_unpurge_blocks(Pool* p, int32_t first, int32_t last);
+void pool_unpurge_all(Pool* p);
+bool pool_add_size_class(size_t size);
+void pool_profile_record(size_t size);
+size_t pool_suggest_size_classes(size_t *classes, size_t *saved, size_t max_classes);
 
-static inline uint8_t size_to_pool(const size_t as)
+extern int32_t pool_custom_sizes[POOL_CUSTOM_COUNT];
+extern _Atomic(int32_t) pool_custom_count;
+extern bool pool_profiling;
+
+static inline uint8_t size_to_fixed_pool(const size_t as)
 {
     static const int bmask = ~0x7f;
     if ((bmask & as) == 0) {
@@ -44,6 +55,49 @@ static inline uint8_t size_to_pool(const size_t as)
     }
 }
 
+static inline int32_t pool_block_size(const uint32_t pc)
+{
+    return pc < POOL_FIXED_COUNT ? pool_sizes[pc] : pool_custom_sizes[pc - POOL_FIXED_COUNT];
+}
+
+// the row of the fixed table a class sits in, custom classes included.
+static inline int32_t pool_row(const uint32_t pc)
+{
+    return (pc < POOL_FIXED_COUNT ? pc : size_to_fixed_pool(pool_block_size(pc))) / 8;
+}
+
+static inline uint8_t size_to_pool(const size_t as)
+{
+    uint8_t pc = size_to_fixed_pool(as);
+    int32_t count = atomic_load_explicit(&pool_custom_count, memory_order_acquire);
+    // the smallest registered class that is tighter than the fixed one.
+    int32_t best = pool_sizes[pc];
+    for (int32_t i = 0; i < count; i++) {
+        int32_t c = pool_custom_sizes[i];
+        if (c >= (int32_t)as && c < best) {
+            best = c;
+            pc = (uint8_t)(POOL_FIXED_COUNT + i);
+        }
+    }
+    return pc;
+}
+
+// smallest request size that maps to the class.
+static inline size_t pool_class_floor(const uint32_t pc)
+{
+    int32_t size = pool_block_size(pc);
+    uint8_t fixed = size_to_fixed_pool(size);
+    int32_t floor = fixed == 0 ? 0 : pool_sizes[fixed - 1];
+    int32_t count = atomic_load_explicit(&pool_custom_count, memory_order_acquire);
+    for (int32_t i = 0; i < count; i++) {
+        int32_t c = pool_custom_sizes[i];
+        if (c < size && c > floor) {
+            floor = c;
+        }
+    }
+    return floor == 0 ? 0 : (size_t)floor + 1;
+}
+
 static inline bool pool_is_connected(Pool *p) { return p->prev != NULL || p->next != NULL; }
 static inline bool pool_is_unused(const Pool *p) {
     int32_t thread_free_count = (int32_t)atomic_load(&p->thread_free_counter);
@@ -52,7 +106,7 @@ static inline bool pool_is_unused(const Pool *p) {
 static inline bool pool_is_fully_commited(const Pool *p) { return p->num_committed >= p->num_available; }
 static inline uint8_t* pool_base_address(Pool *p)
 {
-    return (uint8_t*)(ALIGN_UP_2((uintptr_t)p + sizeof(Pool), p->alignment));
+    return (uint8_t*)p + p->data_offset;
 }
 
 static inline void pool_post_unused(Pool *p)
@@ -80,10 +134,19 @@ static inline void pool_post_used(Pool *p)
     arena_use_blocks(arena, pidx);
 }
 
+static inline void pool_touch(Pool *p)
+{
+    uint8_t pid = partition_id_from_addr((uintptr_t)p);
+    Arena *arena = (Arena *)((uintptr_t)p & ~(region_size_from_partition_id(pid) - 1));
+    arena_touch(arena, 1ULL << (p->idx >> 4));
+}
+
 static inline void pool_clear(Pool *p)
 {
     p->num_committed = 0; // so we hand out contigous blocks again
+    p->num_used = 0;
     p->free = NULL;
+    p->thread_free = NULL;
     p->thread_free_counter = 0;
     p->deferred_free = NULL;
 }
@@ -114,8 +177,54 @@ static inline void pool_move_deferred(Pool *p)
     p->deferred_free = NULL;
 }
 
+// occupancy counting remote frees as returned, they are claimed on the next
+// pass over the pool.
+static inline pool_occupancy pool_occupancy_of(const Pool *p)
+{
+    int32_t in_use = p->num_used - (int32_t)atomic_load(&p->thread_free_counter);
+    if (in_use <= 0) {
+        return POOL_EMPTY;
+    }
+    if (in_use >= p->num_available) {
+        return POOL_FULL;
+    }
+    return (in_use * 2 >= p->num_available) ? POOL_MOSTLY_FULL : POOL_MOSTLY_EMPTY;
+}
+
+static inline Queue *pool_queue(Allocator *a, const Pool *p)
+{
+    return &a->pools[p->block_idx * POOL_OCCUPANCY_BINS + p->bin];
+}
+
+static inline bool pool_is_queued(Allocator *a, Pool *p)
+{
+    return pool_is_connected(p) || pool_queue(a, p)->head == p;
+}
+
+// file the pool under the bin that matches its occupancy now.
+static inline void pool_rebin(Allocator *a, Pool *p)
+{
+    int32_t bin = pool_occupancy_of(p);
+    if (pool_is_queued(a, p)) {
+        if (p->bin == bin) {
+            return;
+        }
+        list_remove(pool_queue(a, p), p);
+    }
+    p->bin = bin;
+    list_enqueue(pool_queue(a, p), p);
+}
+
 static inline void *pool_extend(Pool *p)
 {
+    uint8_t *block = pool_base_address(p) + p->num_committed * p->block_size;
+    Arena *arena = arena_get_header((uintptr_t)p);
+    if (!arena_commit_to(arena, (uintptr_t)block + p->block_size - (uintptr_t)arena)) {
+        return NULL;
+    }
+    if (p->purged != 0) {
+        pool_unpurge_blocks(p, p->num_committed, p->num_committed + 1);
+    }
     p->num_used++;
     return (pool_base_address(p) + (p->num_committed++ * p->block_size));
 }
@@ -153,6 +262,9 @@ static inline void *pool_get_free_block(Pool *p)
     if (p->num_used++ == 0) {
         pool_post_used(p);
         p->free = NULL;
+        if (p->purged != 0) {
+            pool_unpurge_blocks(p, 0, 1);
+        }
         return base_addr;
     }
     
@@ -183,6 +295,13 @@ static inline void *pool_aquire_block(Pool *p)
             pool_move_deferred(p);
             return pool_get_free_block(p);
         }
+        if (p->purged != 0) {
+            // only blocks in purged pages are left.
+            pool_unpurge_all(p);
+            if (p->free != NULL) {
+                return pool_get_free_block(p);
+            }
+        }
         return NULL;
     }
 }
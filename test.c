@@ -4,7 +4,11 @@
 #include "arena.h"
 #include "callocator.inl"
 #include <stdlib.h>
+#include <time.h>
 #include "pool.h"
+#include "memops.h"
+#include "partition_allocator.h"
+#include "os.h"
 #include <assert.h>
 #include <stdatomic.h>
 
@@ -320,8 +324,9 @@ bool test_alloc_aligned(size_t allocation_size)
             cfree(all);
             goto end;
         }
+        // past 32m the blocks are os mappings, they have no region to stay inside.
         uintptr_t end = align_up((uintptr_t)all, pool_size);
-        if((uintptr_t)all != end)
+        if(allocation_size < (1ULL << 25) && (uintptr_t)all != end)
         {
             intptr_t delta = (end - (uintptr_t)all);
             if (delta < (intptr_t)allocation_size) {
@@ -625,6 +630,1011 @@ bool fillARegion(void)
     return state;
 }
 
+bool test_expand_shrink(void)
+{
+    bool state = true;
+    // pools hand out fixed size blocks, so expanding only works within the block.
+    uint8_t *p = (uint8_t *)cmalloc(100);
+    size_t usable = cexpand(p, 100, 200);
+    if (usable < 100) {
+        state = false;
+    }
+    if (cexpand(p, usable + 1, usable + 1) != 0) {
+        state = false;
+    }
+    if (cshrink(p, 8) != usable) {
+        state = false;
+    }
+    cfree(p);
+
+    // boundary tag blocks can grow into their free neighbour.
+    p = (uint8_t *)cmalloc(40000);
+    memset(p, 1, 40000);
+    usable = cexpand(p, 50000, 60000);
+    if (usable < 50000) {
+        state = false;
+    } else {
+        memset(p, 2, usable);
+        if (p[0] != 2 || p[usable - 1] != 2) {
+            state = false;
+        }
+    }
+    usable = cshrink(p, 1000);
+    if (usable < 1000 || usable >= 40000) {
+        state = false;
+    }
+    cfree(p);
+    return state;
+}
+
+bool test_usable_size(void)
+{
+    bool state = true;
+    // a pool size and a boundary tag size.
+    size_t sizes[] = {100, 40000};
+    for (int i = 0; i < 2; i++) {
+        size_t good = cmalloc_good_size(sizes[i]);
+        size_t actual = 0;
+        uint8_t *p = (uint8_t *)cmalloc_at_least(sizes[i], &actual);
+        if (p == NULL || good < sizes[i] || actual < sizes[i]) {
+            state = false;
+        }
+        if (actual != cmalloc_usable_size(p)) {
+            state = false;
+        }
+        if (p != NULL) {
+            // the whole usable range is ours to write.
+            memset(p, 3, actual);
+        }
+        cfree(p);
+    }
+    if (cmalloc_usable_size(NULL) != 0) {
+        state = false;
+    }
+    return state;
+}
+
+static void *zalloc_remote_free_thread(void *arg)
+{
+    uint8_t **items = (uint8_t **)arg;
+    for (int i = 0; i < 4096; i++) {
+        cfree(items[i]);
+    }
+    return NULL;
+}
+
+bool test_zalloc_recycled(void)
+{
+    bool state = true;
+    size_t zeroed = 0, fresh = 0, zeroed_after = 0, fresh_after = 0;
+    // dirty a few blocks and hand them back.
+    uint8_t *ptrs[64];
+    for (int i = 0; i < 64; i++) {
+        ptrs[i] = (uint8_t *)cmalloc(200);
+        memset(ptrs[i], 0xff, 200);
+    }
+    for (int i = 0; i < 64; i++) {
+        cfree(ptrs[i]);
+    }
+    callocator_zero_stats(&zeroed, &fresh);
+    for (int i = 0; i < 64; i++) {
+        ptrs[i] = (uint8_t *)zalloc(1, 200);
+        for (int j = 0; j < 200; j++) {
+            if (ptrs[i][j] != 0) {
+                state = false;
+            }
+        }
+    }
+    for (int i = 0; i < 64; i++) {
+        cfree(ptrs[i]);
+    }
+    // a fresh os mapping never needs clearing.
+    uint8_t *large = (uint8_t *)zalloc(1, 1 << 26);
+    callocator_zero_stats(&zeroed_after, &fresh_after);
+    if (zeroed_after <= zeroed || fresh_after < fresh + (1 << 26)) {
+        state = false;
+    }
+    if (large == NULL || large[0] != 0 || large[(1 << 26) - 1] != 0) {
+        state = false;
+    }
+    cfree(large);
+    // blocks another thread handed back come off the free list dirty,
+    // even though they sit inside the slot's old bump range.
+    uint8_t **items = (uint8_t **)cmalloc(4096 * sizeof(uint8_t *));
+    for (int i = 0; i < 4096; i++) {
+        items[i] = (uint8_t *)cmalloc(200);
+        memset(items[i], 0xff, 200);
+    }
+    thrd_t thread;
+    thrd_create(&thread, zalloc_remote_free_thread, items);
+    thrd_join(thread, NULL);
+    for (int i = 0; i < 4096; i++) {
+        items[i] = (uint8_t *)zalloc(1, 200);
+        for (int j = 0; j < 200; j++) {
+            if (items[i][j] != 0) {
+                state = false;
+            }
+        }
+    }
+    for (int i = 0; i < 4096; i++) {
+        cfree(items[i]);
+    }
+    cfree(items);
+    return state;
+}
+
+bool test_vma_count(void)
+{
+    bool state = true;
+    void *ptrs[32];
+    size_t before = callocator_vma_count();
+    // neighbouring regions share one reservation and merge once committed.
+    for (int i = 0; i < 32; i++) {
+        ptrs[i] = cmalloc(5 * 1024 * 1024);
+        ((uint8_t *)ptrs[i])[0] = 1;
+    }
+    size_t after = callocator_vma_count();
+    if (after <= before || after - before > 4) {
+        state = false;
+    }
+    for (int i = 0; i < 32; i++) {
+        cfree(ptrs[i]);
+    }
+    return state;
+}
+
+bool test_purge_modes(void)
+{
+    bool state = true;
+    uint8_t *ptrs[32];
+    for (int mode = PURGE_DECOMMIT; mode <= PURGE_FREE; mode++) {
+        callocator_set_purge_mode((purge_mode)mode, mode != PURGE_DECOMMIT);
+        for (int round = 0; round < 2; round++) {
+            for (int i = 0; i < 32; i++) {
+                ptrs[i] = (uint8_t *)zalloc(1, 256);
+                for (int j = 0; j < 256; j++) {
+                    if (ptrs[i][j] != 0) {
+                        state = false;
+                    }
+                }
+                memset(ptrs[i], 0xff, 256);
+            }
+            for (int i = 0; i < 32; i++) {
+                cfree(ptrs[i]);
+            }
+            callocator_release();
+        }
+    }
+    // whatever is still writable can be dropped for good.
+    callocator_decommit_idle();
+    callocator_set_purge_mode(PURGE_DONTNEED, false);
+    uint8_t *p = (uint8_t *)zalloc(1, 256);
+    if (p == NULL || p[0] != 0 || p[255] != 0) {
+        state = false;
+    }
+    cfree(p);
+    return state;
+}
+
+static bool drain_held(void **regions, int n, uintptr_t addr)
+{
+    for (int i = 0; i < n; i++) {
+        if ((uintptr_t)regions[i] == addr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool test_drain_neighbours(void)
+{
+    bool state = true;
+    PartitionAllocator *palloc = partition_allocator__create();
+    uintptr_t region_size = palloc->partitions[0].blockSize / 64;
+    void *regions[512];
+    int32_t region_idx = 0;
+    int32_t is_zero = 0;
+    int n = 0;
+    uintptr_t span = 0;
+    // earlier users may have left regions live anywhere, so take regions
+    // until we hold four in a row that run over a block boundary.
+    while (span == 0 && n < 512) {
+        void *r = partition_allocator_allocate_from_partition(palloc, 0, 1, &region_idx, &is_zero, false, false);
+        if (r == NULL) {
+            break;
+        }
+        regions[n++] = r;
+        for (uintptr_t k = 0; k < 4 && span == 0; k++) {
+            uintptr_t first = (uintptr_t)r - k * region_size;
+            PartitionLoc loc;
+            if (get_partition_location(palloc, (void *)first, &loc) == -1 || loc.region != 62) {
+                continue;
+            }
+            if (drain_held(regions, n, first) && drain_held(regions, n, first + region_size) &&
+                drain_held(regions, n, first + 2 * region_size) && drain_held(regions, n, first + 3 * region_size)) {
+                span = first;
+            }
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if ((uintptr_t)regions[i] < span || (uintptr_t)regions[i] >= span + 4 * region_size) {
+            partition_allocator_free_blocks(palloc, regions[i], false);
+        }
+    }
+    if (span == 0) {
+        return false;
+    }
+    for (uintptr_t k = 0; k < 4; k++) {
+        partition_allocator_free_blocks(palloc, (void *)(span + k * region_size), k == 3);
+    }
+    // the last release drains everything it touches in one go.
+    for (uintptr_t k = 0; k < 4; k++) {
+        PartitionLoc loc;
+        get_partition_location(palloc, (void *)(span + k * region_size), &loc);
+        PartitionMasks *block = &palloc->partitions[0].blocks[loc.block];
+        uint64_t bit = 1ULL << loc.region;
+        if ((atomic_load(&block->pending_release) & bit) || (atomic_load(&block->committed) & bit)) {
+            state = false;
+        }
+    }
+    return state;
+}
+
+bool test_maintenance(void)
+{
+    bool state = true;
+    PartitionAllocator *palloc = partition_allocator__create();
+    uint8_t *ptrs[32];
+    // purge everything on every tick.
+    if (!callocator_start_maintenance(1, 0)) {
+        return false;
+    }
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 32; i++) {
+            ptrs[i] = (uint8_t *)cmalloc(256);
+            memset(ptrs[i], 0xff, 256);
+        }
+        for (int i = 0; i < 32; i++) {
+            cfree(ptrs[i]);
+        }
+        callocator_release();
+    }
+    struct timespec ts = { 0, 50 * 1000000 };
+    nanosleep(&ts, NULL);
+    if (partition_allocator_pending_bytes(palloc) != 0) {
+        state = false;
+    }
+    callocator_stop_maintenance();
+    return state;
+}
+
+bool test_home_blocks(void)
+{
+    bool state = true;
+    PartitionAllocator *palloc = partition_allocator__create();
+    int32_t home_a = -1, home_b = -1;
+    int32_t region_idx = 0, is_zero = 0;
+    PartitionLoc a0, a1, b0;
+    void *ra0 = partition_allocator_get_free_region(palloc, 2, 1, &region_idx, &is_zero, false, false, &home_a);
+    void *rb0 = partition_allocator_get_free_region(palloc, 2, 1, &region_idx, &is_zero, false, false, &home_b);
+    void *ra1 = partition_allocator_get_free_region(palloc, 2, 1, &region_idx, &is_zero, false, false, &home_a);
+    if (ra0 == NULL || rb0 == NULL || ra1 == NULL) {
+        return false;
+    }
+    get_partition_location(palloc, ra0, &a0);
+    get_partition_location(palloc, ra1, &a1);
+    get_partition_location(palloc, rb0, &b0);
+    // each caller keeps to its own block.
+    if (a0.block != a1.block || a0.block == b0.block) {
+        state = false;
+    }
+    partition_allocator_free_blocks(palloc, ra0, true);
+    partition_allocator_free_blocks(palloc, ra1, true);
+    partition_allocator_free_blocks(palloc, rb0, true);
+    return state;
+}
+
+bool test_hugepages(void)
+{
+    bool state = true;
+    PartitionAllocator *palloc = partition_allocator__create();
+    if (partition_allocator_purge_granule(1) != os_page_size) {
+        state = false;
+    }
+    // without a hugetlb pool this has to fall back to advising.
+    callocator_set_hugepages(HUGEPAGE_EXPLICIT, 8 * SZ_MB);
+    if (partition_allocator_purge_granule(1) != HUGE_PAGE_SIZE ||
+        partition_allocator_purge_granule(0) != os_page_size) {
+        state = false;
+    }
+    // idle regions lose their rights, so the next ones get committed again.
+    callocator_decommit_idle();
+    int32_t home = -1, region_idx = 0, is_zero = 0;
+    uint8_t *regions[4];
+    for (int i = 0; i < 4; i++) {
+        regions[i] = (uint8_t *)partition_allocator_get_free_region(palloc, 1, 1, &region_idx, &is_zero, true, false, &home);
+        if (regions[i] == NULL) {
+            state = false;
+            continue;
+        }
+        for (size_t j = 0; j < 8 * SZ_MB; j += 4096) {
+            if (regions[i][j] != 0) {
+                state = false;
+            }
+            regions[i][j] = 1;
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        if (regions[i] != NULL) {
+            partition_allocator_free_blocks(palloc, regions[i], true);
+        }
+    }
+    callocator_set_hugepages(HUGEPAGE_NONE, 0);
+    return state;
+}
+
+bool test_pool_purge(void)
+{
+    bool state = true;
+    const size_t num_items = 64 * 1024;
+    uint8_t **items = (uint8_t **)malloc(num_items * sizeof(uint8_t *));
+    for (size_t i = 0; i < num_items; i++) {
+        items[i] = (uint8_t *)cmalloc(256);
+        memset(items[i], (int)i, 256);
+    }
+    int full_pages = get_committed_pages();
+    // a few survivors keep every pool alive.
+    for (size_t i = 0; i < num_items; i++) {
+        if (i % 97 != 0) {
+            cfree(items[i]);
+            items[i] = NULL;
+        }
+    }
+    callocator_release();
+    if (get_committed_pages() >= full_pages) {
+        state = false;
+    }
+    for (size_t i = 0; i < num_items; i += 97) {
+        for (size_t j = 0; j < 256; j++) {
+            if (items[i][j] != (uint8_t)i) {
+                state = false;
+            }
+        }
+    }
+    // the purged blocks come back without overlapping the survivors.
+    for (size_t i = 0; i < num_items; i++) {
+        if (items[i] == NULL) {
+            items[i] = (uint8_t *)cmalloc(256);
+            memset(items[i], (int)i, 256);
+        }
+    }
+    for (size_t i = 0; i < num_items; i++) {
+        for (size_t j = 0; j < 256; j++) {
+            if (items[i][j] != (uint8_t)i) {
+                state = false;
+            }
+        }
+        cfree(items[i]);
+    }
+    free(items);
+    return state;
+}
+
+static void *occupancy_free_thread(void *arg)
+{
+    uint8_t **items = (uint8_t **)arg;
+    for (size_t i = 0; i < 1024; i++) {
+        cfree(items[i]);
+    }
+    return NULL;
+}
+
+bool test_pool_occupancy(void)
+{
+    bool state = true;
+    const size_t num_items = 1024;
+    uint8_t **items = (uint8_t **)malloc(num_items * sizeof(uint8_t *));
+    for (size_t i = 0; i < num_items; i++) {
+        items[i] = (uint8_t *)cmalloc(1024);
+    }
+    Arena *arena = arena_get_header((uintptr_t)items[0]);
+    uintptr_t chunk_mask = ~(ARENA_CHUNK_SIZE(arena->partition_id) - 1);
+    uintptr_t full_pool = (uintptr_t)items[0] & chunk_mask;
+    uintptr_t sparse_pool = (uintptr_t)items[num_items - 1] & chunk_mask;
+    if (full_pool == sparse_pool) {
+        state = false;
+    }
+    // the newest pool keeps one block, the oldest gives back a few.
+    size_t full_freed = 0;
+    for (size_t i = 0; i < num_items; i++) {
+        uintptr_t pool = (uintptr_t)items[i] & chunk_mask;
+        if ((pool == sparse_pool && i != num_items - 1) || (pool == full_pool && full_freed < 8)) {
+            full_freed += pool == full_pool;
+            cfree(items[i]);
+            items[i] = NULL;
+        }
+    }
+    callocator_release();
+    // new blocks fill the fuller pools before the sparse one.
+    for (size_t i = 0; i < num_items && full_freed > 0; i++) {
+        if (items[i] == NULL) {
+            full_freed--;
+            items[i] = (uint8_t *)cmalloc(1024);
+            if (((uintptr_t)items[i] & chunk_mask) == sparse_pool) {
+                state = false;
+            }
+        }
+    }
+    for (size_t i = 0; i < num_items; i++) {
+        cfree(items[i]);
+    }
+    // pools another thread emptied are filled again instead of new ones.
+    uintptr_t pools[64];
+    size_t num_pools = 0, first_round = 0;
+    for (int round = 0; round < 8; round++) {
+        for (size_t i = 0; i < num_items; i++) {
+            items[i] = (uint8_t *)cmalloc(1024);
+            uintptr_t pool = (uintptr_t)items[i] & chunk_mask;
+            size_t k = 0;
+            while (k < num_pools && pools[k] != pool) {
+                k++;
+            }
+            if (k == num_pools && num_pools < 64) {
+                pools[num_pools++] = pool;
+            }
+        }
+        if (round == 0) {
+            first_round = num_pools;
+        }
+        thrd_t thread;
+        thrd_create(&thread, occupancy_free_thread, items);
+        thrd_join(thread, NULL);
+    }
+    if (num_pools > first_round * 2) {
+        state = false;
+    }
+    free(items);
+    return state;
+}
+
+bool test_pool_retention(void)
+{
+    bool state = true;
+    const size_t num_items = 48 * 1024;
+    uint8_t **items = (uint8_t **)malloc(num_items * sizeof(uint8_t *));
+    for (size_t i = 0; i < num_items; i++) {
+        items[i] = (uint8_t *)cmalloc(64);
+    }
+    Arena *arena = arena_get_header((uintptr_t)items[0]);
+    uint64_t chunk_size = ARENA_CHUNK_SIZE(arena->partition_id);
+    for (size_t i = 0; i < num_items; i++) {
+        cfree(items[i]);
+    }
+    // after the burst only a capped number of empty pools stay cached.
+    size_t cached = 0;
+    uintptr_t last = 0;
+    for (size_t i = 0; i < num_items; i++) {
+        uintptr_t chunk = ALIGN_DOWN_2((uintptr_t)items[i], chunk_size);
+        if (chunk != last) {
+            Arena *a = arena_get_header(chunk);
+            uint32_t idx = (uint32_t)((chunk - (uintptr_t)a) / chunk_size);
+            cached += (atomic_load(&a->active) >> idx) & 1;
+            last = chunk;
+        }
+    }
+    if (cached > POOL_RETAIN_MAX + 2) {
+        state = false;
+    }
+    free(items);
+    return state;
+}
+
+bool test_address_ordered(void)
+{
+    bool state = true;
+    const size_t num_items = 128;
+    uint8_t *items[128];
+    callocator_set_placement(PLACEMENT_ADDRESS_ORDERED);
+    uintptr_t low = UINTPTR_MAX;
+    uintptr_t high = 0;
+    for (size_t i = 0; i < num_items; i++) {
+        items[i] = (uint8_t *)cmalloc(96 * 1024);
+        uintptr_t arena = (uintptr_t)arena_get_header((uintptr_t)items[i]);
+        low = MIN(low, arena);
+        high = MAX(high, arena);
+    }
+    if (low == high) {
+        state = false;
+    }
+    // free the same number of runs at both ends.
+    size_t low_freed = 0;
+    size_t high_freed = 0;
+    for (size_t i = 0; i < num_items; i++) {
+        uintptr_t arena = (uintptr_t)arena_get_header((uintptr_t)items[i]);
+        if ((arena == low && low_freed < 4) || (arena == high && high_freed < 4)) {
+            low_freed += arena == low;
+            high_freed += arena == high;
+            cfree(items[i]);
+            items[i] = NULL;
+        }
+    }
+    callocator_release();
+    // the low arena fills up before the high one.
+    size_t refill = low_freed;
+    for (size_t i = 0; i < num_items && refill > 0; i++) {
+        if (items[i] == NULL) {
+            refill--;
+            items[i] = (uint8_t *)cmalloc(96 * 1024);
+            if ((uintptr_t)arena_get_header((uintptr_t)items[i]) > low) {
+                state = false;
+            }
+        }
+    }
+    for (size_t i = 0; i < num_items; i++) {
+        cfree(items[i]);
+    }
+    // a new thread starts on the lowest block with room, not one of its own.
+    PartitionAllocator *palloc = partition_allocator__create();
+    int32_t home = -1;
+    int32_t region_idx = 0, is_zero = 0;
+    void *region = partition_allocator_get_free_region(palloc, 0, 1, &region_idx, &is_zero, false, false, &home);
+    if (region == NULL || home != 0) {
+        state = false;
+    }
+    if (region != NULL) {
+        partition_allocator_free_blocks(palloc, region, false);
+    }
+    callocator_set_placement(PLACEMENT_FIRST_FIT);
+    return state;
+}
+
+bool test_cold_pools(void)
+{
+    bool state = true;
+    // every release halves the pool demand, let all classes cool down.
+    for (int i = 0; i < 8; i++) {
+        callocator_release();
+    }
+    uint8_t *items[64];
+    for (int i = 0; i < 64; i++) {
+        items[i] = (uint8_t *)cmalloc(20 * 1024);
+        memset(items[i], i, 20 * 1024);
+    }
+    // the first pool of a cold class comes from a small chunk, the class
+    // moves up to full chunks once it keeps asking.
+    if (partition_id_from_addr((uintptr_t)items[0]) >= 5) {
+        state = false;
+    }
+    if (partition_id_from_addr((uintptr_t)items[63]) != 5) {
+        state = false;
+    }
+    for (int i = 0; i < 64; i++) {
+        for (int j = 0; j < 20 * 1024; j++) {
+            if (items[i][j] != (uint8_t)i) {
+                state = false;
+                break;
+            }
+        }
+        cfree(items[i]);
+    }
+    return state;
+}
+
+bool test_size_classes(void)
+{
+    bool state = true;
+    uint8_t *items[256];
+    callocator_profile_sizes(true);
+    for (int i = 0; i < 256; i++) {
+        items[i] = (uint8_t *)cmalloc(i & 1 ? 136 : 3000);
+    }
+    callocator_profile_sizes(false);
+    for (int i = 0; i < 256; i++) {
+        cfree(items[i]);
+    }
+    // the two hot sizes are the classes that save the most.
+    size_t classes[2];
+    size_t saved[2];
+    if (callocator_suggest_size_classes(classes, saved, 2) != 2) {
+        return false;
+    }
+    if (MIN(classes[0], classes[1]) != 136 || MAX(classes[0], classes[1]) != 3000) {
+        state = false;
+    }
+    if (!callocator_add_size_class(136) || !callocator_add_size_class(3000)) {
+        return false;
+    }
+    if (cmalloc_good_size(136) != 136 || cmalloc_good_size(130) != 136 || cmalloc_good_size(140) != 144) {
+        state = false;
+    }
+    for (int i = 0; i < 256; i++) {
+        items[i] = (uint8_t *)cmalloc(i & 1 ? 136 : 3000);
+        memset(items[i], i, i & 1 ? 136 : 3000);
+        if (cmalloc_usable_size(items[i]) != (i & 1 ? 136 : 3000)) {
+            state = false;
+        }
+    }
+    // a stricter alignment than the class keeps falls back to the fixed table.
+    void *aligned = caligned_alloc(16, 2992);
+    if (aligned == NULL || !IS_ALIGNED(aligned, 16)) {
+        state = false;
+    }
+    cfree(aligned);
+    for (int i = 0; i < 256; i++) {
+        size_t size = i & 1 ? 136 : 3000;
+        for (size_t j = 0; j < size; j++) {
+            if (items[i][j] != (uint8_t)i) {
+                state = false;
+                break;
+            }
+        }
+        cfree(items[i]);
+    }
+    return state;
+}
+
+static void *header_padding_thread(void *arg)
+{
+    bool *state = (bool *)arg;
+    uint8_t *items[4096];
+    for (int i = 0; i < 4096; i++) {
+        items[i] = (uint8_t *)cmalloc(56);
+        memset(items[i], i, 56);
+    }
+    for (int i = 0; i < 4096; i++) {
+        Arena *arena = arena_get_header((uintptr_t)items[i]);
+        uintptr_t pool = ALIGN_DOWN_2((uintptr_t)items[i], ARENA_CHUNK_SIZE(arena->partition_id));
+        if (ALIGN_DOWN_2((uintptr_t)items[i], DEFAULT_OS_PAGE_SIZE) == ALIGN_DOWN_2(pool, DEFAULT_OS_PAGE_SIZE)) {
+            *state = false;
+        }
+    }
+    for (int i = 0; i < 4096; i++) {
+        cfree(items[i]);
+    }
+    return NULL;
+}
+
+bool test_header_padding(void)
+{
+    // pools of a fresh thread never share a page with their header.
+    bool state = true;
+    thrd_t thread;
+    callocator_set_header_padding(true);
+    thrd_create(&thread, header_padding_thread, &state);
+    thrd_join(thread, NULL);
+    callocator_set_header_padding(false);
+    return state;
+}
+
+bool test_idle_aging(void)
+{
+    bool state = true;
+    uint8_t *items[16];
+    for (int i = 0; i < 16; i++) {
+        items[i] = (uint8_t *)cmalloc(96 * 1024);
+        memset(items[i], i + 1, 96 * 1024);
+    }
+    callocator_release();
+    Arena *arena = arena_get_header((uintptr_t)items[0]);
+    uint64_t chunk_size = ARENA_CHUNK_SIZE(arena->partition_id);
+    uint64_t held = 0;
+    for (int i = 0; i < 16; i++) {
+        if (arena_get_header((uintptr_t)items[i]) == arena) {
+            held |= 1ULL << (((uintptr_t)items[i] - (uintptr_t)arena) / chunk_size);
+        }
+    }
+    held &= atomic_load(&arena->in_use);
+    callocator_set_aging(1000, 4000);
+    // the clock is driven by hand, every chunk was last touched at now.
+    uint64_t now = (uint64_t)1 << 30;
+    for (int i = 0; i < 64; i++) {
+        arena->touched[i] = (uint32_t)(now >> ARENA_AGE_SHIFT);
+    }
+    // nothing has gone idle yet.
+    if (arena_age_idle(arena, now, 0) != 0 || (atomic_load(&arena->cold) & held) != 0) {
+        state = false;
+    }
+    // a while later the untouched chunks go cold, and later still out.
+    arena_age_idle(arena, now + 2000, 0);
+    if (held == 0 || (atomic_load(&arena->cold) & held) != held || (atomic_load(&arena->paged) & held) != 0) {
+        state = false;
+    }
+    arena_age_idle(arena, now + 5000, 0);
+    if ((atomic_load(&arena->paged) & held) != held) {
+        state = false;
+    }
+    // the data survives, and handing a chunk back warms it up again.
+    for (int i = 0; i < 16; i++) {
+        for (size_t j = 0; j < 96 * 1024; j += 4096) {
+            if (items[i][j] != i + 1) {
+                state = false;
+                break;
+            }
+        }
+    }
+    uint64_t first = 1ULL << (((uintptr_t)items[0] - (uintptr_t)arena) / chunk_size);
+    cfree(items[0]);
+    if ((atomic_load(&arena->cold) & first) != 0) {
+        state = false;
+    }
+    callocator_set_aging(0, 0);
+    for (int i = 1; i < 16; i++) {
+        cfree(items[i]);
+    }
+    return state;
+}
+
+static void *commit_step_thread(void *arg)
+{
+    bool *state = (bool *)arg;
+    uint8_t *runs[8];
+    uint8_t *small[512];
+    for (int i = 0; i < 8; i++) {
+        runs[i] = (uint8_t *)cmalloc(96 * 1024);
+        memset(runs[i], 0xcd, 96 * 1024);
+    }
+    for (int i = 0; i < 512; i++) {
+        small[i] = (uint8_t *)cmalloc(200);
+        memset(small[i], 0xcd, 200);
+    }
+    // a fresh arena is only writable as far as it has been used.
+    Arena *arena = arena_get_header((uintptr_t)runs[0]);
+    uint64_t mark = atomic_load(&arena->commit_end);
+    if (mark >= ARENA_SIZE(arena->partition_id)) {
+        *state = false;
+    }
+    for (int i = 0; i < 8; i++) {
+        if (arena_get_header((uintptr_t)runs[i]) == arena &&
+            (uintptr_t)runs[i] + 96 * 1024 > (uintptr_t)arena + mark) {
+            *state = false;
+        }
+    }
+    // so is an implicit list, its end tags aside.
+    uint8_t *big = (uint8_t *)cmalloc(6 * 1024 * 1024);
+    memset(big, 0xcd, 6 * 1024 * 1024);
+    uint8_t *more = (uint8_t *)cmalloc(5 * 1024 * 1024);
+    memset(more, 0xcd, 5 * 1024 * 1024);
+    uint64_t region_size = area_size_from_addr((uintptr_t)big);
+    ImplicitList *list = (ImplicitList *)ALIGN_DOWN_2(big, region_size);
+    if (atomic_load(&list->commit_end) >= region_size) {
+        *state = false;
+    }
+    // and a realloc that grows in place commits what it grows into.
+    uint8_t *grown = (uint8_t *)crealloc(more, 7 * 1024 * 1024);
+    memset(grown, 0xab, 7 * 1024 * 1024);
+    cfree(grown);
+    cfree(big);
+    for (int i = 0; i < 512; i++) {
+        cfree(small[i]);
+    }
+    for (int i = 0; i < 8; i++) {
+        cfree(runs[i]);
+    }
+    return NULL;
+}
+
+bool test_commit_step(void)
+{
+    bool state = true;
+    thrd_t thread;
+    callocator_set_commit_step(64 * 1024);
+    thrd_create(&thread, commit_step_thread, &state);
+    thrd_join(thread, NULL);
+    callocator_set_commit_step(0);
+    // regions left partly writable are made whole for the next user.
+    void *items[4];
+    for (int i = 0; i < 4; i++) {
+        items[i] = cmalloc(6 * 1024 * 1024);
+        memset(items[i], 0xef, 6 * 1024 * 1024);
+    }
+    for (int i = 0; i < 4; i++) {
+        cfree(items[i]);
+    }
+    return state;
+}
+
+bool test_slot_other_class(void)
+{
+    // with free blocks in the cached pool, a size of another class still
+    // gets a block of its own size.
+    void *items[10];
+    for (int i = 0; i < 10; i++) {
+        items[i] = cmalloc(200);
+    }
+    cfree(items[3]);
+    cfree(items[5]);
+    items[3] = cmalloc(200);
+    void *big = cmalloc(6 * 1024 * 1024);
+    bool state = big != NULL && cmalloc_usable_size(big) >= 6 * 1024 * 1024;
+    cfree(big);
+    for (int i = 0; i < 10; i++) {
+        if (i != 5) {
+            cfree(items[i]);
+        }
+    }
+    return state;
+}
+
+static void *adopt_leave_thread(void *arg)
+{
+    void **kept = (void **)arg;
+    kept[1] = cmalloc(96 * 1024);
+    kept[2] = cmalloc(6 * 1024 * 1024);
+    // the pool is still cached in the slot when the thread exits.
+    kept[0] = cmalloc(200);
+    return NULL;
+}
+
+static void *adopt_take_thread(void *arg)
+{
+    void **kept = (void **)arg;
+    uintptr_t list = ALIGN_DOWN_2(kept[2], area_size_from_addr((uintptr_t)kept[2]));
+    void *items[3][64];
+    bool found[3] = {false, false, false};
+    int n = 0;
+    // other dead threads may have left room of their own, it goes first
+    // when it is lower down.
+    for (; n < 64 && !(found[0] && found[1] && found[2]); n++) {
+        items[0][n] = cmalloc(200);
+        items[1][n] = cmalloc(96 * 1024);
+        items[2][n] = cmalloc(6 * 1024 * 1024);
+        found[0] |= arena_get_header((uintptr_t)items[0][n]) == arena_get_header((uintptr_t)kept[0]);
+        found[1] |= arena_get_header((uintptr_t)items[1][n]) == arena_get_header((uintptr_t)kept[1]);
+        found[2] |= ALIGN_DOWN_2(items[2][n], area_size_from_addr((uintptr_t)items[2][n])) == list;
+    }
+    for (int i = 0; i < n; i++) {
+        cfree(items[0][i]);
+        cfree(items[1][i]);
+        cfree(items[2][i]);
+    }
+    kept[3] = (void *)(uintptr_t)(found[0] && found[1] && found[2]);
+    return NULL;
+}
+
+static void *adopt_release_thread(void *arg)
+{
+    void **kept = (void **)arg;
+    // the frees adopt what is left, after that nothing may stay behind.
+    cfree(kept[0]);
+    cfree(kept[1]);
+    cfree(kept[2]);
+    kept[4] = (void *)(uintptr_t)callocator_release();
+    return NULL;
+}
+
+bool test_adopt_abandoned(void)
+{
+    // a thread that exits with blocks still out leaves its arenas and
+    // implicit lists behind, the next thread that needs room takes them.
+    void *kept[5] = {NULL, NULL, NULL, NULL, NULL};
+    thrd_t thread;
+    thrd_create(&thread, adopt_leave_thread, kept);
+    thrd_join(thread, NULL);
+    thrd_create(&thread, adopt_take_thread, kept);
+    thrd_join(thread, NULL);
+    thrd_create(&thread, adopt_release_thread, kept);
+    thrd_join(thread, NULL);
+    return kept[3] != NULL && kept[4] != NULL;
+}
+
+bool test_chunk_purge(void)
+{
+    bool state = true;
+    // a long lived run keeps the arena alive while the others go idle.
+    uint8_t *keep = (uint8_t *)cmalloc(96 * 1024);
+    uint8_t *items[16];
+    for (int i = 0; i < 16; i++) {
+        items[i] = (uint8_t *)cmalloc(96 * 1024);
+        memset(items[i], 0xab, 96 * 1024);
+    }
+    Arena *arena = arena_get_header((uintptr_t)keep);
+    uint64_t chunk_size = ARENA_CHUNK_SIZE(arena->partition_id);
+    uint64_t freed = 0;
+    for (int i = 0; i < 16; i++) {
+        if (arena_get_header((uintptr_t)items[i]) == arena) {
+            freed |= 1ULL << (((uintptr_t)items[i] - (uintptr_t)arena) / chunk_size);
+        }
+        cfree(items[i]);
+    }
+    callocator_release();
+    if (freed == 0) {
+        cfree(keep);
+        return false;
+    }
+    // one sweep to see them idle, the next a decay interval later purges them.
+    uint64_t now = arena->idle_since + ARENA_CHUNK_DECAY;
+    arena_purge_idle(arena, now, 0);
+    arena_purge_idle(arena, now + ARENA_CHUNK_DECAY, 0);
+    uint64_t purged = atomic_load(&arena->purged);
+    if ((purged & freed) != freed) {
+        state = false;
+    }
+    // purged chunks read back as zero and are marked that way.
+    if ((atomic_load(&arena->zero) & purged) != purged) {
+        state = false;
+    }
+    for (int i = 0; i < 16; i++) {
+        items[i] = (uint8_t *)zalloc(1, 96 * 1024);
+        for (size_t j = 0; j < 96 * 1024; j++) {
+            if (items[i][j] != 0) {
+                state = false;
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < 16; i++) {
+        cfree(items[i]);
+    }
+    cfree(keep);
+    return state;
+}
+
+bool test_layout(void)
+{
+    bool state = true;
+    uintptr_t base = 0;
+    size_t partition_size = 0;
+    callocator_get_layout(&base, &partition_size);
+    if (!POWER_OF_TWO(partition_size) || (base & (partition_size - 1)) != 0) {
+        return false;
+    }
+    // every partition maps back to its id, and nothing outside does.
+    for (int32_t pid = 0; pid < PARTITION_COUNT; pid++) {
+        uintptr_t start = base + pid * partition_size;
+        if (partition_id_from_addr(start) != pid ||
+            partition_id_from_addr(start + partition_size - 1) != pid) {
+            state = false;
+        }
+    }
+    if (partition_id_from_addr(base - 1) != -1 ||
+        partition_id_from_addr(base + PARTITION_COUNT * partition_size) != -1) {
+        state = false;
+    }
+    uint8_t *p = (uint8_t *)cmalloc(1024 * 1024);
+    p[0] = 1;
+    if ((uintptr_t)p < base || (uintptr_t)p >= base + PARTITION_COUNT * partition_size) {
+        state = false;
+    }
+    // blocks have been reserved, the layout can't move any more.
+    if (callocator_set_layout(base, partition_size / 2)) {
+        state = false;
+    }
+    cfree(p);
+    return state;
+}
+
+bool test_memops(void)
+{
+    bool state = true;
+    // one size per kernel, with odd lengths and misaligned ends.
+    size_t sizes[] = {100, 5000 + 3, (3 << 20) + 13};
+    for (int i = 0; i < 3; i++) {
+        size_t n = sizes[i];
+        uint8_t *src = (uint8_t *)malloc(n + 64);
+        uint8_t *dst = (uint8_t *)malloc(n + 64);
+        for (size_t j = 0; j < n + 64; j++) {
+            src[j] = (uint8_t)(j * 7 + 1);
+        }
+        memset(dst, 0xff, n + 64);
+        mem_copy(dst + 3, src + 5, n);
+        if (memcmp(dst + 3, src + 5, n) != 0 || dst[2] != 0xff || dst[n + 3] != 0xff) {
+            state = false;
+        }
+        mem_zero(dst + 1, n);
+        for (size_t j = 1; j < n + 1; j++) {
+            if (dst[j] != 0) {
+                state = false;
+                break;
+            }
+        }
+        if (dst[0] != 0xff || dst[n + 1] != src[n + 3]) {
+            state = false;
+        }
+        free(src);
+        free(dst);
+    }
+    return state;
+}
 
 void run_tests(void)
 {
@@ -648,6 +1658,29 @@ void run_tests(void)
     TEST(Allocator, fillAPool, { EXPECT(fillAPool()); });
     TEST(Allocator, fillAChunk, { EXPECT(fillAChunk()); });
     TEST(Allocator, fillARegion, { EXPECT(fillARegion()); });
+    TEST(Allocator, expand_shrink, { EXPECT(test_expand_shrink()); });
+    TEST(Allocator, usable_size, { EXPECT(test_usable_size()); });
+    TEST(Allocator, zalloc_recycled, { EXPECT(test_zalloc_recycled()); });
+    TEST(Allocator, memops, { EXPECT(test_memops()); });
+    TEST(Allocator, vma_count, { EXPECT(test_vma_count()); });
+    TEST(Allocator, purge_modes, { EXPECT(test_purge_modes()); });
+    TEST(Allocator, drain_neighbours, { EXPECT(test_drain_neighbours()); });
+    TEST(Allocator, maintenance, { EXPECT(test_maintenance()); });
+    TEST(Allocator, home_blocks, { EXPECT(test_home_blocks()); });
+    TEST(Allocator, layout, { EXPECT(test_layout()); });
+    TEST(Allocator, hugepages, { EXPECT(test_hugepages()); });
+    TEST(Allocator, pool_purge, { EXPECT(test_pool_purge()); });
+    TEST(Allocator, chunk_purge, { EXPECT(test_chunk_purge()); });
+    TEST(Allocator, pool_occupancy, { EXPECT(test_pool_occupancy()); });
+    TEST(Allocator, pool_retention, { EXPECT(test_pool_retention()); });
+    TEST(Allocator, address_ordered, { EXPECT(test_address_ordered()); });
+    TEST(Allocator, cold_pools, { EXPECT(test_cold_pools()); });
+    TEST(Allocator, size_classes, { EXPECT(test_size_classes()); });
+    TEST(Allocator, header_padding, { EXPECT(test_header_padding()); });
+    TEST(Allocator, idle_aging, { EXPECT(test_idle_aging()); });
+    TEST(Allocator, commit_step, { EXPECT(test_commit_step()); });
+    TEST(Allocator, slot_other_class, { EXPECT(test_slot_other_class()); });
+    TEST(Allocator, adopt_abandoned, { EXPECT(test_adopt_abandoned()); });
     END_TEST(Allocator, {});
     if(!callocator_release())
     {
@@ -949,6 +1982,186 @@ void test_size_iter_sparse_reverse(size_t num_items, size_t num_loops,int t, siz
     free(variables);
 }
 
+void test_copy_kernels(size_t size, size_t num_loops)
+{
+    START_TEST(memops, {});
+    uint8_t *src = (uint8_t *)malloc(size);
+    uint8_t *dst = (uint8_t *)malloc(size);
+    memset(src, 1, size);
+    memset(dst, 2, size);
+    MEASURE_TIME(memops, memcpy, {
+        for (uint64_t j = 0; j < num_loops; j++) {
+            memcpy(dst, src, size);
+            __asm__ __volatile__("" : : "r"(dst) : "memory");
+        }
+    });
+    MEASURE_TIME(memops, mem_copy, {
+        for (uint64_t j = 0; j < num_loops; j++) {
+            mem_copy(dst, src, size);
+            __asm__ __volatile__("" : : "r"(dst) : "memory");
+        }
+    });
+    MEASURE_TIME(memops, memset, {
+        for (uint64_t j = 0; j < num_loops; j++) {
+            memset(dst, 0, size);
+            __asm__ __volatile__("" : : "r"(dst) : "memory");
+        }
+    });
+    MEASURE_TIME(memops, mem_zero, {
+        for (uint64_t j = 0; j < num_loops; j++) {
+            mem_zero(dst, size);
+            __asm__ __volatile__("" : : "r"(dst) : "memory");
+        }
+    });
+    END_TEST(memops, {});
+    free(src);
+    free(dst);
+}
+
+typedef struct
+{
+    size_t num_loops;
+} region_churn_args;
+
+static void *region_churn_thread(void *arg)
+{
+    region_churn_args *args = (region_churn_args *)arg;
+    PartitionAllocator *palloc = partition_allocator__create();
+    void *regions[16];
+    int32_t home = -1;
+    int32_t region_idx = 0, is_zero = 0;
+    for (size_t j = 0; j < args->num_loops; j++) {
+        for (int i = 0; i < 16; i++) {
+            regions[i] = partition_allocator_get_free_region(palloc, 0, 1, &region_idx, &is_zero, false, false, &home);
+        }
+        for (int i = 0; i < 16; i++) {
+            if (regions[i] != NULL) {
+                partition_allocator_free_blocks(palloc, regions[i], false);
+            }
+        }
+    }
+    return NULL;
+}
+
+// threads handing regions out and back on neighbouring partition blocks.
+// purging is deferred so only the metadata traffic is measured.
+void test_region_churn(int num_threads, size_t num_loops)
+{
+    START_TEST(partition, {});
+    thrd_t threads[64];
+    region_churn_args args = { num_loops };
+    partition_allocator_defer_purge(true);
+    MEASURE_TIME(partition, region_churn, {
+        for (int i = 0; i < num_threads; i++) {
+            thrd_create(&threads[i], region_churn_thread, &args);
+        }
+        for (int i = 0; i < num_threads; i++) {
+            thrd_join(threads[i], NULL);
+        }
+    });
+    partition_allocator_defer_purge(false);
+    END_TEST(partition, {});
+}
+
+// has to run before anything else allocates, the allocator itself is set
+// up by a constructor before main.
+void test_startup(void)
+{
+    START_TEST(startup, {});
+    int init_pages = get_committed_pages();
+    void *p = NULL;
+    MEASURE_TIME(startup, first_cmalloc, {
+        p = cmalloc(64);
+    });
+    int first_pages = get_committed_pages();
+    printf("Resident pages after init %d, after first allocation %d\n", init_pages, first_pages);
+    cfree(p);
+    END_TEST(startup, {});
+}
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+static int dtlb_counter_open(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+static void dtlb_counter_start(int counter)
+{
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+}
+static long long dtlb_counter_stop(int counter)
+{
+    long long misses = -1;
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) {
+        return -1;
+    }
+    return misses;
+}
+static void dtlb_counter_close(int counter) { close(counter); }
+#else
+static int dtlb_counter_open(void) { return -1; }
+static void dtlb_counter_start(int counter) { UNUSED(counter); }
+static long long dtlb_counter_stop(int counter) { UNUSED(counter); return -1; }
+static void dtlb_counter_close(int counter) { UNUSED(counter); }
+#endif
+
+// Random reads over 256MB of 64KB allocations, once per huge page mode.
+// Reports dTLB read misses where the kernel lets us count them.
+void test_dtlb(void)
+{
+    const size_t num_items = 4096;
+    const size_t item_size = 64 * 1024;
+    const size_t num_reads = 1 << 24;
+    const char *names[] = {"none", "advise", "explicit"};
+    uint8_t **items = (uint8_t **)malloc(num_items * sizeof(uint8_t *));
+    int counter = dtlb_counter_open();
+    for (int mode = HUGEPAGE_NONE; mode <= HUGEPAGE_EXPLICIT; mode++) {
+        callocator_set_hugepages((hugepage_mode)mode, 0);
+        // everything from earlier rounds stays allocated, so each round
+        // is served from freshly committed regions.
+        for (size_t i = 0; i < num_items; i++) {
+            items[i] = (uint8_t *)cmalloc(item_size);
+            memset(items[i], (int)i, item_size);
+        }
+        uint64_t seed = 88172645463325252ULL;
+        uint64_t sum = 0;
+        long long misses = -1;
+        if (counter >= 0) {
+            dtlb_counter_start(counter);
+        }
+        clock_t start = clock();
+        for (size_t i = 0; i < num_reads; i++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            sum += items[seed % num_items][(seed >> 32) % item_size];
+        }
+        double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+        if (counter >= 0) {
+            misses = dtlb_counter_stop(counter);
+        }
+        printf("hugepages %-8s %8.3fs dTLB read misses %lld (%llu)\n", names[mode], elapsed, misses,
+               (unsigned long long)(sum & 0xff));
+    }
+    callocator_set_hugepages(HUGEPAGE_NONE, 0);
+    if (counter >= 0) {
+        dtlb_counter_close(counter);
+    }
+    free(items);
+}
 
 void test_size_arena_iter(uint32_t alloc_size, size_t num_items, size_t num_loops)
 {
@@ -984,6 +2197,14 @@ int main(int argc, char *argv[])
             
             test_local = 0;
         }
+        if (strcmp(argv[1], "startup") == 0) {
+            test_startup();
+            return 0;
+        }
+        if (strcmp(argv[1], "dtlb") == 0) {
+            test_dtlb();
+            return 0;
+        }
     }
 
     //run_tests();
@@ -1038,5 +2259,15 @@ int main(int argc, char *argv[])
 
     test_size_iter_sparse(NUMBER_OF_ITEMS/10, NUMBER_OF_ITERATIONS, test_local, 1024*1024);
 
+    printf("Test region churn across partition blocks -> threads: [1,..32], num_iterations %llu\n", (unsigned long long)NUMBER_OF_ITERATIONS);
+    for (int i = 1; i <= 32; i *= 2) {
+        test_region_churn(i, NUMBER_OF_ITERATIONS * 100);
+    }
+
+    printf("Test copy/zero kernels against libc (features %u) -> size: [4k,..64m]\n", memops_get_features());
+    for (int i = 12; i <= 26; i += 2) {
+        test_copy_kernels(1ULL << i, (1ULL << 32) >> i);
+    }
+
     return 0;
 }